@@ -5,6 +5,8 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 #include "mem.h"
 
 /*
@@ -13,7 +15,7 @@
  * The blocks are ordered in the increasing order of addresses
  */
 typedef struct blk_hdr {
-    int size_status;
+    size_t size_status;
     
     /*
      * Size of the block is always a multiple of 8
@@ -30,7 +32,10 @@ typedef struct blk_hdr {
      */
     
     /*
-     * Examples:
+     * The header is one machine word: 4 bytes in the 32-bit build of
+     * libmem.so, 8 bytes in the 64-bit libmem64.so
+     *
+     * Examples (assuming the 32-bit build):
      *
      * For a busy block with a payload of 20 bytes (i.e. 20 bytes data + an additional 4 bytes for header)
      * Header:
@@ -47,266 +52,2957 @@ typedef struct blk_hdr {
      */
 } blk_hdr;
 
+/*
+ * This structure is overlaid on the payload of each free block to
+ * thread it into its segregated free-list bin
+ * The list is doubly linked so a block can be unlinked in constant
+ * time when coalescing absorbs it
+ * Free blocks are always large enough to hold it (see MIN_BLK_SIZE)
+ */
+typedef struct free_blk {
+    struct free_blk *next;
+    struct free_blk *prev;
+} free_blk;
+
+/* Size of a block header (and of a free block's footer) - one word */
+#define HDR_SIZE ((size_t)sizeof(blk_hdr))
+
+/*
+ * Smallest block we ever create: header + room for the free-list
+ * links + footer, rounded up to a multiple of 8
+ */
+#define MIN_BLK_SIZE ((HDR_SIZE + sizeof(free_blk) + HDR_SIZE + 7) & ~(size_t)7)
+
+/*
+ * This structure is overlaid on the payload of free blocks too large
+ * for the exact bins to index them in a treap keyed by block size
+ * Blocks of equal size hang off the resident tree node in a doubly
+ * linked duplicate chain, so the tree holds one node per distinct size
+ * Every block above BIN_MAX_SIZE is large enough to hold it
+ */
+typedef struct tree_blk {
+    struct tree_blk *left;
+    struct tree_blk *right;
+    struct tree_blk *eq_next;   // duplicate chain of same-size blocks
+    struct tree_blk *eq_prev;
+    size_t prio;                // heap priority, hashed from address
+} tree_blk;
+
+/* Largest block size served by the exact bins - bigger free blocks
+ * are indexed in the size treap instead */
+#define BIN_MAX_SIZE ((size_t)128)
+
+/*
+ * Number of segregated free-list bins
+ * Bin i holds exactly the blocks of size MIN_BLK_SIZE + 8*i, up to
+ * BIN_MAX_SIZE; everything larger lives in the arena's size treap
+ */
+#define NUM_BINS ((int)((BIN_MAX_SIZE - MIN_BLK_SIZE) / 8) + 1)
+
+/*
+ * One contiguous mapped span of heap memory
+ * The struct itself lives at the start of its mapping, followed by
+ * the first block and terminated by an end mark, so an arena can
+ * chain additional regions without any out-of-band allocation
+ */
+typedef struct region {
+    struct region *next;        // next region owned by the same arena
+    char *base;                 // first byte of the mapping
+    char *limit;                // one past the last byte of the mapping
+    char *high_water;           // one past the highest byte ever
+                                // written in the region; everything
+                                // above is still untouched mmap zeros
+    blk_hdr *first;             // first block in the region
+} region;
+
+/*
+ * Per-arena allocator state
+ * Mem_Init carves the mapped region into one span per arena; each
+ * thread is bound to an arena on its first allocation, so threads
+ * contend only with the other threads bound to the same arena
+ * When every arena is exhausted, the allocator maps a fresh region
+ * and chains it onto the requesting thread's arena
+ */
+typedef struct arena {
+    pthread_mutex_t lock;
+    void *remote_frees;         // lock-free MPSC stack of blocks freed
+                                // by threads bound to other arenas,
+                                // drained at the next allocation
+    void *deferred;             // blocks freed while coalescing is
+                                // deferred, waiting for the next batch
+    int deferred_count;
+    region *regions;            // mapped regions, newest first
+    int rover;                  // bin where the last next-fit search
+                                // ended; the next one resumes there
+    region region0;             // descriptor for the arena's initial
+                                // Mem_Init span, kept here so the span
+                                // itself loses no space to metadata
+    size_t last_alloc_dirty;    // dirty-prefix length of the payload
+                                // most recently handed out by
+                                // arena_alloc (see Mem_Calloc)
+    size_t mutations;           // bumped whenever block boundaries
+                                // change, so the Mem_Validate cursor
+                                // can tell it has gone stale
+    free_blk *bins[NUM_BINS];   // exact segregated free-list bins
+    tree_blk *tree;             // size treap of the larger free blocks
+    mem_stats stats;            // counters, kept up to date by the
+                                // paths that change them so
+                                // Mem_GetStats never walks the heap
+} arena;
+
+/* Upper bound on arenas - Mem_SetArenaCount clamps to this */
+#define MAX_ARENAS 64
+
+static arena arenas[MAX_ARENAS];
+
+/* Number of arenas carved out by Mem_Init (0 until initialized) */
+static int num_arenas = 0;
+
+/* Arena count requested via Mem_SetArenaCount before Mem_Init */
+static int requested_arenas = 1;
+
+/* Round-robin cursor used to bind threads to arenas */
+static int next_arena = 0;
+
+/* Size used for regions mapped on heap exhaustion - the size of the
+ * first Mem_Init region, so the heap grows in initial-sized steps */
+static size_t grow_region_size = 0;
+
+/* Whether the heap may map additional regions when it runs out
+ * (off by default: a bounded heap fails allocations when full) */
+static int growable = 0;
+
+/* Placement policy driving the free-list search (see mem.h) */
+static int policy = MEM_POLICY_BEST;
+
+/* Whether Mem_Free defers coalescing to batched sweeps (off by
+ * default: blocks coalesce immediately as they always have) */
+static int defer_coalescing = 0;
+
+/* Whether heap regions ask for 2 MB pages - MAP_HUGETLB when the
+ * kernel pool has them, MADV_HUGEPAGE otherwise (off by default) */
+static int huge_pages = 0;
+
+/* Smallest remainder worth splitting off a chosen free block - a
+ * remainder below this is left attached, trading a few bytes of
+ * internal padding for never minting sliver free blocks
+ * Defaults to the structural minimum; raised via Mem_SetMinSplit */
+static size_t min_split = MIN_BLK_SIZE;
+
+/* Deferred blocks waiting in an arena before a batch sweep runs */
+#define DEFER_THRESHOLD 512
+
+/* Key written into a deferred block's payload so a double free of a
+ * queued block is still caught even though its busy bit is set */
+#define DEFER_KEY ((size_t)0x44454652)
+
+/* Whether the debug guard/quarantine mode is on (off by default):
+ * direct mappings get a trailing PROT_NONE page so overruns fault on
+ * the spot, and freed blocks are poisoned and parked in a bounded
+ * quarantine before reuse so stale reads hit poison */
+static int debug_guards = 0;
+
+/* Set once any guarded mapping exists, so the free path never peeks
+ * behind a payload for a guard header it cannot have */
+static int guards_used = 0;
+
+/* Bounds of the quarantine rings - small blocks parked before reuse
+ * and retired guarded mappings kept PROT_NONE before unmapping */
+#define QUAR_BLOCKS 256
+#define QUAR_MAPS 16
+
+/* Byte written over a quarantined payload; a read of freed memory
+ * returns it and a write is detected when the block leaves the ring */
+#define QUAR_POISON 0x5a
+
+/* Key written into a quarantined block's payload so a double free of
+ * a parked block is caught, the DEFER_KEY trick */
+#define QUAR_KEY ((size_t)0x51554152)
+
+static void *quar_ring[QUAR_BLOCKS];
+static int quar_pos = 0;
+static struct {
+    void *base;
+    size_t len;
+} quar_maps[QUAR_MAPS];
+static int quar_map_pos = 0;
+static pthread_mutex_t quar_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Round-robin cursor for attaching extra Mem_Init regions */
+static int grow_cursor = 0;
+
+/* Set once the heap exists - by Mem_Init or Mem_InitFromFile */
+static int allocated_once = 0;
+
+/* The arena this thread allocates from (-1 until first allocation) */
+static __thread int my_arena = -1;
+
 /* Global variable - This will always point to the first block
- * i.e. the block with the lowest address */
+ * of the first arena, i.e. the block with the lowest address */
 blk_hdr *first_blk = NULL;
 
 /*
- * Note:
- *  The end of the available memory can be determined using end_mark
- *  The size_status of end_mark has a value of 1
- *
+ * Allocations at least this many payload bytes bypass the arenas and
+ * get a dedicated mapping, so one huge buffer neither fragments the
+ * heap nor keeps its pages resident after it is freed
+ * Configurable before or after Mem_Init via Mem_SetMmapThreshold;
+ * a threshold of 0 disables the direct path
+ */
+#define MMAP_THRESHOLD_DEFAULT ((size_t)256 * 1024)
+static size_t mmap_threshold = MMAP_THRESHOLD_DEFAULT;
+
+/* Bytes and mappings currently allocated via the direct path,
+ * reported as busy by Mem_GetStats */
+static size_t mmap_bytes = 0;
+static int mmap_blocks = 0;
+
+/* Magic word that marks the page-aligned header of a direct mapping */
+#define MMAP_MAGIC ((size_t)0x4d6d6170)
+
+/*
+ * Header placed at the start of a dedicated mapping; the payload
+ * follows it, which keeps the payload 8-byte aligned
+ */
+typedef struct mmap_hdr {
+    size_t map_size;    // total size of the mapping in bytes
+    size_t magic;       // MMAP_MAGIC while the mapping is live
+} mmap_hdr;
+
+/* Magic word behind a guarded direct mapping's payload */
+#define GUARD_MAGIC ((size_t)0x47756172)
+
+/*
+ * Header of a guarded direct mapping (see Mem_SetDebugGuards)
+ * The payload sits flush against a trailing PROT_NONE page, so this
+ * header lives right before the payload instead of at the mapping
+ * start and has to remember where the mapping begins
+ */
+typedef struct guard_hdr {
+    size_t map_size;    // total size of the mapping, guard included
+    void *base;         // first byte of the mapping
+    size_t magic;       // GUARD_MAGIC while the mapping is live
+} guard_hdr;
+
+/*
+ * Requests of at most this many payload bytes are served from slab
+ * pages instead of boundary-tag blocks, paying no per-object header
+ * Off by default (0); enabled via Mem_SetSlabThreshold
+ */
+static size_t slab_max = 0;
+
+/* Magic word that marks the page-aligned header of a slab page */
+#define SLAB_MAGIC ((size_t)0x536c6162)
+
+/* Slot sizes are multiples of 8 up to SLAB_MAX_CLASSES * 8 bytes */
+#define SLAB_MAX_CLASSES 16
+
+/* Words in a slab page's slot bitmap - caps the slots per page */
+#define SLAB_BITMAP_WORDS 8
+
+/*
+ * Header at the start of each slab page
+ * The slots follow the header back to back with no per-object
+ * metadata; a set bitmap bit means the slot is busy
+ * Freeing rounds the payload address down to the page boundary to
+ * find this header, the same trick mmap_hdr uses
+ */
+typedef struct slab {
+    size_t magic;               // SLAB_MAGIC while the page is live
+    struct slab *next;          // partial-page list of the class
+    struct slab *prev;
+    int class;                  // slot size is (class + 1) * 8
+    int free_count;             // free slots left in the page
+    int total;                  // slots the page holds
+    unsigned long bitmap[SLAB_BITMAP_WORDS];
+} slab;
+
+/* First slot offset inside a slab page */
+#define SLAB_SLOTS_OFF ((sizeof(slab) + 7) & ~(size_t)7)
+
+/*
+ * Per-class slab state: the pages of the class that still have a free
+ * slot; full pages leave the list and return on their first free
+ */
+static struct {
+    pthread_mutex_t lock;
+    slab *partial;
+} slab_classes[SLAB_MAX_CLASSES];
+
+/* Bytes and objects currently allocated from slab pages, reported as
+ * busy by Mem_GetStats */
+static size_t slab_bytes = 0;
+static int slab_objects = 0;
+
+/*
+ * Sampled heap profiler
+ * Every prof_rate-th allocated byte records the caller's return
+ * address and the block size into a fixed ring; the unsampled path
+ * costs one thread-local credit decrement and a branch, cheap enough
+ * to stay enabled in production
+ */
+#define PROF_RING 4096
+
+typedef struct prof_sample {
+    void *site;                 // return address of the caller
+    size_t bytes;               // size of the sampled allocation
+} prof_sample;
+
+static prof_sample prof_ring[PROF_RING];
+static unsigned int prof_pos = 0;
+
+/* Sampling rate in bytes; 0 (the default) disables the profiler */
+static size_t prof_rate = 0;
+
+/* Bytes left until this thread's next sample */
+static __thread long prof_credit = 0;
+
+/*
+ * Counts 'bytes' against this thread's sampling credit and records a
+ * sample when it runs out - the one-decrement fast path
+ */
+static void prof_account(size_t bytes, void *site) {
+    if (prof_rate == 0) {
+        return;
+    }
+    prof_credit -= (long)bytes;
+    if (prof_credit >= 0) {
+        return;
+    }
+    prof_credit = (long)prof_rate;
+    unsigned int at = __atomic_fetch_add(&prof_pos, 1,
+                                         __ATOMIC_RELAXED) % PROF_RING;
+    prof_ring[at].site = site;
+    prof_ring[at].bytes = bytes;
+}
+
+/*
+ * Tracing is compiled in only for debug builds (make debug) so the
+ * release library pays nothing for it on the allocation path
+ */
+#ifdef MEM_DEBUG
+static mem_trace_fn trace_fn = NULL;
+
+#define MEM_TRACE(op, ptr, size)            \
+    do {                                    \
+        if (trace_fn != NULL)               \
+            trace_fn((op), (ptr), (size));  \
+    } while (0)
+
+void Mem_SetTraceCallback(mem_trace_fn fn) {
+    trace_fn = fn;
+}
+#else
+#define MEM_TRACE(op, ptr, size) do { } while (0)
+
+void Mem_SetTraceCallback(mem_trace_fn fn) {
+    (void)fn;
+}
+#endif
+
+/*
+ * Note:
+ *  The end of the available memory can be determined using end_mark
+ *  The size_status of end_mark has a value of 1
+ *
+ */
+
+/*
+ * Returns the size of a block (header flags stripped)
+ */
+static size_t blk_size(blk_hdr *blk) {
+    return blk->size_status & ~(size_t)3;
+}
+
+/*
+ * Optional per-block canaries (compile with -DMEM_CANARY)
+ * Every boundary-tag block carries a magic word, keyed to the block
+ * address, in its last payload word; it is armed whenever the block
+ * is handed out and checked by Mem_Free, so an overrun is caught at
+ * the free of the overrun block instead of as a mystery crash inside
+ * a later free-list traversal
+ * Slab slots and direct mappings have no header and carry no canary
+ * In release builds the pad is zero and the helpers compile away
+ */
+#ifdef MEM_CANARY
+#define CANARY_PAD sizeof(size_t)
+#define CANARY_WORD(blk) (*(size_t*)((char*)(blk) + blk_size(blk) \
+                                     - sizeof(size_t)))
+#define CANARY_VALUE(blk) ((size_t)0x43414e4152590000u ^ (size_t)(blk))
+
+static void canary_arm(void *ptr) {
+    if (ptr != NULL) {
+        blk_hdr *blk = (blk_hdr*)((char*)ptr - HDR_SIZE);
+        CANARY_WORD(blk) = CANARY_VALUE(blk);
+    }
+}
+
+static int canary_check_busy(void *ptr) {
+    blk_hdr *blk = (blk_hdr*)((char*)ptr - HDR_SIZE);
+    // an already-free block has links where the canary was; the
+    // caller rejects it through the usual double-free check
+    if ((blk->size_status & 1) == 0) {
+        return 0;
+    }
+    return CANARY_WORD(blk) == CANARY_VALUE(blk) ? 0 : -1;
+}
+#else
+#define CANARY_PAD 0
+
+static void canary_arm(void *ptr) {
+    (void)ptr;
+}
+
+static int canary_check_busy(void *ptr) {
+    (void)ptr;
+    return 0;
+}
+#endif
+
+/*
+ * Maps a block size (a multiple of 8 between MIN_BLK_SIZE and
+ * BIN_MAX_SIZE) to the index of its exact free-list bin
+ */
+static int bin_index(size_t size) {
+    return (int)((size - MIN_BLK_SIZE) / 8);
+}
+
+/*
+ * Returns the size of the block a tree node is embedded in - the key
+ * the treap is ordered by
+ */
+static size_t tree_key(tree_blk *node) {
+    return blk_size((blk_hdr*)((char*)node - HDR_SIZE));
+}
+
+/*
+ * Derives a pseudo-random treap priority from the node's address, so
+ * the tree stays balanced in expectation without storing any state
+ */
+static size_t tree_prio(tree_blk *node) {
+    size_t h = (size_t)node * (size_t)2654435761u;
+    return h ^ (h >> 16);
+}
+
+static tree_blk* tree_rotate_right(tree_blk *n) {
+    tree_blk *l = n->left;
+    n->left = l->right;
+    l->right = n;
+    return l;
+}
+
+static tree_blk* tree_rotate_left(tree_blk *n) {
+    tree_blk *r = n->right;
+    n->right = r->left;
+    r->left = n;
+    return r;
+}
+
+/*
+ * Inserts a node into the subtree at root and returns the new root
+ * An equal-sized resident node adopts the newcomer into its duplicate
+ * chain instead, keeping the tree one node per distinct size
+ */
+static tree_blk* tree_insert(tree_blk *root, tree_blk *node) {
+    if (root == NULL) {
+        return node;
+    }
+    size_t key = tree_key(node);
+    size_t root_key = tree_key(root);
+    if (key == root_key) {
+        node->eq_next = root->eq_next;
+        if (root->eq_next != NULL) {
+            root->eq_next->eq_prev = node;
+        }
+        node->eq_prev = root;
+        root->eq_next = node;
+    } else if (key < root_key) {
+        root->left = tree_insert(root->left, node);
+        if (root->left->prio > root->prio) {
+            root = tree_rotate_right(root);
+        }
+    } else {
+        root->right = tree_insert(root->right, node);
+        if (root->right->prio > root->prio) {
+            root = tree_rotate_left(root);
+        }
+    }
+    return root;
+}
+
+/*
+ * Removes the root of a subtree by rotating it down to a leaf along
+ * the higher-priority child, preserving the heap order on the way
+ */
+static tree_blk* tree_delete_root(tree_blk *n) {
+    if (n->left == NULL) {
+        return n->right;
+    }
+    if (n->right == NULL) {
+        return n->left;
+    }
+    if (n->left->prio > n->right->prio) {
+        n = tree_rotate_right(n);
+        n->right = tree_delete_root(n->right);
+    } else {
+        n = tree_rotate_left(n);
+        n->left = tree_delete_root(n->left);
+    }
+    return n;
+}
+
+/*
+ * Unlinks one specific node from the subtree at root and returns the
+ * new root
+ * A node on a duplicate chain is unlinked in place; a resident tree
+ * node hands its position to the next duplicate, or is rotated out
+ */
+static tree_blk* tree_remove(tree_blk *root, tree_blk *node) {
+    size_t key = tree_key(node);
+    size_t root_key = tree_key(root);
+    if (key < root_key) {
+        root->left = tree_remove(root->left, node);
+    } else if (key > root_key) {
+        root->right = tree_remove(root->right, node);
+    } else if (root != node) {
+        // equal sizes are always chained under the resident node
+        node->eq_prev->eq_next = node->eq_next;
+        if (node->eq_next != NULL) {
+            node->eq_next->eq_prev = node->eq_prev;
+        }
+    } else if (node->eq_next != NULL) {
+        // promote the next duplicate into the tree position
+        tree_blk *heir = node->eq_next;
+        heir->eq_prev = NULL;
+        heir->left = node->left;
+        heir->right = node->right;
+        heir->prio = node->prio;
+        return heir;
+    } else {
+        return tree_delete_root(node);
+    }
+    return root;
+}
+
+/*
+ * Returns the node with the smallest key >= size - the best fit -
+ * in O(log n), or NULL if no block in the tree is large enough
+ */
+static tree_blk* tree_lower_bound(tree_blk *root, size_t size) {
+    tree_blk *best = NULL;
+    while (root != NULL) {
+        if (tree_key(root) >= size) {
+            best = root;
+            root = root->left;
+        } else {
+            root = root->right;
+        }
+    }
+    return best;
+}
+
+/*
+ * Indexes a free block: small blocks go onto the front of their exact
+ * size-class bin, larger ones into the arena's size treap
+ */
+static void bin_insert(arena *a, blk_hdr *blk) {
+    size_t size = blk_size(blk);
+    if (size <= BIN_MAX_SIZE) {
+        int idx = bin_index(size);
+        free_blk *node = (free_blk*)((char*)blk + HDR_SIZE);
+        node->next = a->bins[idx];
+        node->prev = NULL;
+        if (a->bins[idx] != NULL) {
+            a->bins[idx]->prev = node;
+        }
+        a->bins[idx] = node;
+    } else {
+        tree_blk *node = (tree_blk*)((char*)blk + HDR_SIZE);
+        node->left = NULL;
+        node->right = NULL;
+        node->eq_next = NULL;
+        node->eq_prev = NULL;
+        node->prio = tree_prio(node);
+        a->tree = tree_insert(a->tree, node);
+    }
+    a->stats.bytes_free += size;
+    a->stats.free_blocks += 1;
+}
+
+/*
+ * Unlinks a free block from its index - constant time for the exact
+ * bins, O(log n) for the treap
+ */
+static void bin_remove(arena *a, blk_hdr *blk) {
+    size_t size = blk_size(blk);
+    if (size <= BIN_MAX_SIZE) {
+        free_blk *node = (free_blk*)((char*)blk + HDR_SIZE);
+        if (node->prev != NULL) {
+            node->prev->next = node->next;
+        } else {
+            a->bins[bin_index(size)] = node->next;
+        }
+        if (node->next != NULL) {
+            node->next->prev = node->prev;
+        }
+    } else {
+        a->tree = tree_remove(a->tree,
+                              (tree_blk*)((char*)blk + HDR_SIZE));
+    }
+    a->stats.bytes_free -= size;
+    a->stats.free_blocks -= 1;
+}
+
+/*
+ * Returns the arena whose span contains ptr, or NULL if ptr does not
+ * belong to any arena
+ */
+static arena* arena_for_ptr(void *ptr) {
+    for (int i = 0; i < num_arenas; i++) {
+        for (region *r = arenas[i].regions; r != NULL; r = r->next) {
+            if ((char*)ptr >= r->base && (char*)ptr < r->limit) {
+                return &arenas[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the region of arena a that contains ptr
+ */
+static region* region_of(arena *a, void *ptr) {
+    for (region *r = a->regions; r != NULL; r = r->next) {
+        if ((char*)ptr >= r->base && (char*)ptr < r->limit) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the arena this thread is bound to, binding it round-robin
+ * on its first allocation
+ */
+static arena* arena_for_thread() {
+    if (my_arena < 0) {
+        my_arena = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED)
+                   % num_arenas;
+    }
+    return &arenas[my_arena];
+}
+
+/*
+ * Allocates a block of exactly 'size' bytes (already rounded, header
+ * included) from one arena; the caller holds the arena lock
+ * - Search the segregated free-list bins starting at the size class of
+ *   the rounded size, according to the selected placement policy:
+ *   best fit takes the best block from the first bin holding one that
+ *   is large enough (bins are ordered by size, so that is the global
+ *   best fit); first fit takes the first block that fits; next fit
+ *   resumes the bin walk where the previous search ended and wraps
+ *   around to the skipped bins only when the tail yields nothing
+ * - When allocating a block - split it into two blocks if the
+ *   remainder is large enough to stand on its own
+ * Only free blocks are ever visited - allocated blocks are not on the
+ * free lists, so the cost does not grow with the number of busy blocks
+ */
+static void* arena_alloc(arena *a, size_t size) {
+    // the chosen block and its size
+    blk_hdr *best = NULL;
+    size_t best_size = 0;
+
+    // small requests: walk the exact bins first
+    // every block in a bin has exactly the bin's size, so the first
+    // non-empty bin at or above the request holds a best fit
+    if (size <= BIN_MAX_SIZE) {
+        // where to start the walk (only the next-fit rover ever
+        // starts above the lowest bin that can hold the request)
+        int lowest = bin_index(size);
+        int start = lowest;
+        if (policy == MEM_POLICY_NEXT && a->rover > start) {
+            start = a->rover;
+        }
+
+        // walk the bins upwards from the start, then wrap to the
+        // skipped lower bins if the first pass found nothing
+        for (int pass = 0; pass < 2 && best == NULL; pass++) {
+            int from = (pass == 0) ? start : lowest;
+            int to = (pass == 0) ? NUM_BINS : start;
+            for (int idx = from; idx < to; idx++) {
+                if (a->bins[idx] != NULL) {
+                    best = (blk_hdr*)((char*)a->bins[idx] - HDR_SIZE);
+                    best_size = blk_size(best);
+                    a->rover = idx;
+                    break;
+                }
+            }
+        }
+    }
+
+    // large requests - and small ones no bin could satisfy - are
+    // answered by the size treap with one lower-bound lookup, an
+    // O(log n) exact best fit regardless of policy
+    if (best == NULL) {
+        tree_blk *node = tree_lower_bound(a->tree, size);
+        if (node != NULL) {
+            best = (blk_hdr*)((char*)node - HDR_SIZE);
+            best_size = blk_size(best);
+        }
+    }
+
+    // if no free block can accommodate the request
+    if (best == NULL) {
+        return NULL;
+    }
+
+    // take the block off its free list
+    bin_remove(a, best);
+    a->mutations += 1;
+
+    // split the block if the remainder is worth keeping as a free
+    // block (at least min_split bytes)
+    if (best_size - size >= min_split) {
+        // the allocated front part keeps the previous-block bit
+        best->size_status = size + (best->size_status & 2) + 1;
+        // the remainder becomes a free block with its own header/footer
+        blk_hdr *remainder = (blk_hdr*)((char*)best + size);
+        remainder->size_status = (best_size - size) + 2;
+        blk_hdr *footer = (blk_hdr*)((char*)best + best_size - HDR_SIZE);
+        footer->size_status = best_size - size;
+        bin_insert(a, remainder);
+    } else {
+        // allocate the whole block
+        best->size_status += 1;
+        // tell the following block that its predecessor is now busy
+        // (the end mark has size 0 and never carries that bit)
+        blk_hdr *next = (blk_hdr*)((char*)best + best_size);
+        if (blk_size(next) != 0) {
+            next->size_status += 2;
+        }
+    }
+
+    // account for the block that just became busy
+    a->stats.bytes_busy += blk_size(best);
+    a->stats.busy_blocks += 1;
+    if (a->stats.bytes_busy > a->stats.peak_bytes_busy) {
+        a->stats.peak_bytes_busy = a->stats.bytes_busy;
+    }
+
+    // remember how much of this payload had been written before, so
+    // Mem_Calloc can clear only that prefix (the wilderness footer
+    // just below the end mark is dirty from day one, hence the
+    // conservative tail check)
+    region *r = region_of(a, best);
+    char *payload_start = (char*)best + HDR_SIZE;
+    char *payload_end = (char*)best + blk_size(best);
+    if (r == NULL || payload_end > r->limit - 2 * HDR_SIZE) {
+        a->last_alloc_dirty = (size_t)(payload_end - payload_start);
+    } else if (payload_start >= r->high_water) {
+        a->last_alloc_dirty = 0;
+    } else if (r->high_water < payload_end) {
+        a->last_alloc_dirty = (size_t)(r->high_water - payload_start);
+    } else {
+        a->last_alloc_dirty = (size_t)(payload_end - payload_start);
+    }
+
+    // advance the high-water mark of ever-touched memory: the caller
+    // may dirty the whole payload, and a split has just written the
+    // remainder's index links right past it (Mem_Calloc relies on
+    // everything above the mark still being untouched mmap zeros)
+    char *touched = (char*)best + best_size;
+    if (blk_size(best) < best_size) {
+        size_t rem = best_size - blk_size(best);
+        size_t links = (rem <= BIN_MAX_SIZE) ? sizeof(free_blk)
+                                             : sizeof(tree_blk);
+        touched = (char*)best + blk_size(best) + HDR_SIZE + links;
+    }
+    if (r != NULL && touched > r->high_water) {
+        r->high_water = touched;
+    }
+
+    // return the payload address
+    return (void*)((char*)best + HDR_SIZE);
+}
+
+/*
+ * Maps anonymous memory for one heap region
+ * MAP_NORESERVE keeps an over-sized heap from committing anything up
+ * front - pages materialize as blocks are first touched
+ * With huge pages enabled the mapping is first tried from the
+ * MAP_HUGETLB pool (rounding the length up to 2 MB), and falls back
+ * to ordinary pages flagged MADV_HUGEPAGE so transparent huge pages
+ * can back the region even when no pool is configured
+ * On success *bytes holds the (possibly rounded) mapping length
+ */
+/*
+ * Returns nonzero when the kernel's huge-page pool has at least
+ * 'pages' free 2 MB pages
+ * A MAP_HUGETLB mmap can succeed against an empty pool and deliver
+ * SIGBUS on the first touch, so the pool is checked up front; read
+ * through a raw descriptor since the heap may not exist yet
+ */
+static int huge_pool_has(size_t pages) {
+    int fd = open("/proc/meminfo", O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    char buf[4096];
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = '\0';
+    char *line = strstr(buf, "HugePages_Free:");
+    if (line == NULL) {
+        return 0;
+    }
+    size_t avail = 0;
+    for (char *c = line + 15; *c != '\0' && *c != '\n'; c++) {
+        if (*c >= '0' && *c <= '9') {
+            avail = avail * 10 + (size_t)(*c - '0');
+        }
+    }
+    return avail >= pages;
+}
+
+static void* map_region(size_t *bytes) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+#ifdef MAP_HUGETLB
+    if (huge_pages) {
+        size_t huge = (size_t)2 * 1024 * 1024;
+        size_t rounded = (*bytes + huge - 1) & ~(huge - 1);
+        if (huge_pool_has(rounded / huge)) {
+            void *mem = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+                             flags | MAP_HUGETLB, -1, 0);
+            if (MAP_FAILED != mem) {
+                *bytes = rounded;
+                return mem;
+            }
+        }
+        // no huge-page pool - fall through to ordinary pages
+    }
+#endif
+    void *mem = mmap(NULL, *bytes, PROT_READ | PROT_WRITE, flags,
+                     -1, 0);
+    if (MAP_FAILED == mem) {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge_pages) {
+        madvise(mem, *bytes, MADV_HUGEPAGE);
+    }
+#endif
+    return mem;
+}
+
+/*
+ * Lays one big free block and an end mark over a fresh mapping and
+ * chains it onto the arena
+ * The descriptor r normally embeds itself at the start of the mapping;
+ * Mem_Init passes the arena's built-in region0 instead so the initial
+ * span loses no space to it
+ * The caller holds the arena lock (or is still in Mem_Init)
+ */
+static void region_attach(arena *a, region *r, void *mem, size_t bytes) {
+    size_t offset = 0;
+    if (r == NULL) {
+        r = (region*)mem;
+        offset = (sizeof(region) + 7) & ~(size_t)7;
+    }
+    r->base = (char*)mem;
+    r->limit = (char*)mem + bytes;
+
+    // place the first block so its payload is double word aligned
+    offset += (8 - HDR_SIZE % 8) % 8;
+    r->first = (blk_hdr*)(r->base + offset);
+    size_t usable = (size_t)(r->limit - (char*)r->first - HDR_SIZE)
+                    & ~(size_t)7;
+
+    // Setting up the header, marking the previous block as busy
+    r->first->size_status = usable + 2;
+
+    // Setting up the end mark and marking it as busy
+    blk_hdr *end_mark = (blk_hdr*)((char*)r->first + usable);
+    end_mark->size_status = 1;
+
+    // Setting up the footer
+    blk_hdr *footer = (blk_hdr*)((char*)r->first + usable - HDR_SIZE);
+    footer->size_status = usable;
+
+    // only the region descriptor, the first block's header and index
+    // links, the footer and the end mark have been written so far
+    size_t links = (usable <= BIN_MAX_SIZE) ? sizeof(free_blk)
+                                            : sizeof(tree_blk);
+    r->high_water = (char*)r->first + HDR_SIZE + links;
+
+    r->next = a->regions;
+    a->regions = r;
+    a->mutations += 1;
+    bin_insert(a, r->first);
+}
+
+/* Smallest extra space a region needs around one block */
+#define REGION_OVERHEAD (sizeof(region) + 4 * HDR_SIZE + 8)
+
+/*
+ * Maps a fresh region large enough for at least one block of 'need'
+ * bytes onto the arena; the caller holds the arena lock
+ * Returns 0 on success and -1 if the mapping fails
+ */
+static int arena_grow(arena *a, size_t need) {
+    size_t page = (size_t)getpagesize();
+    size_t bytes = need + REGION_OVERHEAD;
+    if (bytes < grow_region_size) {
+        bytes = grow_region_size;
+    }
+    bytes = (bytes + page - 1) & ~(page - 1);
+    void *mem = map_region(&bytes);
+    if (mem == NULL) {
+        return -1;
+    }
+    region_attach(a, NULL, mem, bytes);
+    return 0;
+}
+
+/*
+ * Parks one retired guarded mapping, unmapping the one it displaces
+ * The mapping is already PROT_NONE, so between the free and the
+ * eviction every touch of it faults
+ */
+static void quar_push_map(void *base, size_t len) {
+    pthread_mutex_lock(&quar_lock);
+    void *old_base = quar_maps[quar_map_pos].base;
+    size_t old_len = quar_maps[quar_map_pos].len;
+    quar_maps[quar_map_pos].base = base;
+    quar_maps[quar_map_pos].len = len;
+    quar_map_pos = (quar_map_pos + 1) % QUAR_MAPS;
+    pthread_mutex_unlock(&quar_lock);
+    if (old_base != NULL) {
+        munmap(old_base, old_len);
+    }
+}
+
+/*
+ * Serves one large allocation from a dedicated anonymous mapping
+ * In guard mode the payload is placed flush against a trailing
+ * PROT_NONE page (8-byte granularity), so the first overrunning
+ * store faults immediately instead of corrupting a neighbour
+ */
+static void* mmap_alloc(size_t payload) {
+    size_t page = (size_t)getpagesize();
+    if (debug_guards) {
+        size_t pay8 = (payload + 7) & ~(size_t)7;
+        size_t total = (pay8 + sizeof(guard_hdr) + page - 1)
+                       & ~(page - 1);
+        void *map = mmap(NULL, total + page, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == map) {
+            return NULL;
+        }
+        char *guard = (char*)map + total;
+        mprotect(guard, page, PROT_NONE);
+        char *ptr = guard - pay8;
+        guard_hdr *hdr = (guard_hdr*)(ptr - sizeof(guard_hdr));
+        hdr->map_size = total + page;
+        hdr->base = map;
+        hdr->magic = GUARD_MAGIC;
+        guards_used = 1;
+        __atomic_add_fetch(&mmap_bytes, total + page, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&mmap_blocks, 1, __ATOMIC_RELAXED);
+        return ptr;
+    }
+    size_t total = (payload + sizeof(mmap_hdr) + page - 1) & ~(page - 1);
+    void *map = mmap(NULL, total, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == map) {
+        return NULL;
+    }
+    mmap_hdr *hdr = (mmap_hdr*)map;
+    hdr->map_size = total;
+    hdr->magic = MMAP_MAGIC;
+    __atomic_add_fetch(&mmap_bytes, total, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mmap_blocks, 1, __ATOMIC_RELAXED);
+    return (char*)map + sizeof(mmap_hdr);
+}
+
+/*
+ * Returns the direct-mapping header behind ptr, or NULL if ptr was
+ * not handed out by mmap_alloc
+ * Only called for pointers that lie outside every arena, so a stray
+ * heap pointer can never be mistaken for a mapping
+ */
+static mmap_hdr* mmap_hdr_of(void *ptr) {
+    size_t page = (size_t)getpagesize();
+    mmap_hdr *hdr = (mmap_hdr*)((char*)ptr - sizeof(mmap_hdr));
+    if (((size_t)hdr & (page - 1)) != 0 || hdr->magic != MMAP_MAGIC) {
+        return NULL;
+    }
+    return hdr;
+}
+
+/*
+ * Returns the guarded-mapping header behind ptr, or NULL if ptr does
+ * not belong to one; never looks unless guard mode has handed out at
+ * least one mapping
+ */
+static guard_hdr* guard_hdr_of(void *ptr) {
+    if (!guards_used) {
+        return NULL;
+    }
+    guard_hdr *hdr = (guard_hdr*)((char*)ptr - sizeof(guard_hdr));
+    if (hdr->magic != GUARD_MAGIC) {
+        return NULL;
+    }
+    return hdr;
+}
+
+/*
+ * Unmaps a direct mapping, returning its pages to the OS immediately
+ * A guarded mapping instead turns PROT_NONE in place and parks in
+ * the quarantine, so every use after this free faults until the
+ * mapping is finally evicted
+ */
+static int mmap_free(void *ptr) {
+    mmap_hdr *hdr = mmap_hdr_of(ptr);
+    if (hdr == NULL) {
+        guard_hdr *ghdr = guard_hdr_of(ptr);
+        if (ghdr == NULL) {
+            return -1;
+        }
+        void *base = ghdr->base;
+        size_t len = ghdr->map_size;
+        ghdr->magic = 0;
+        __atomic_sub_fetch(&mmap_bytes, len, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&mmap_blocks, 1, __ATOMIC_RELAXED);
+        mprotect(base, len, PROT_NONE);
+        quar_push_map(base, len);
+        return 0;
+    }
+    hdr->magic = 0;
+    __atomic_sub_fetch(&mmap_bytes, hdr->map_size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&mmap_blocks, 1, __ATOMIC_RELAXED);
+    return munmap(hdr, hdr->map_size);
+}
+
+/*
+ * Maps and initializes a fresh slab page for one size class and puts
+ * it at the head of the class's partial list; the caller holds the
+ * class lock
+ */
+static slab* slab_page_new(int cls) {
+    size_t page = (size_t)getpagesize();
+    void *map = mmap(NULL, page, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == map) {
+        return NULL;
+    }
+    slab *s = (slab*)map;
+    s->magic = SLAB_MAGIC;
+    s->class = cls;
+
+    size_t slot_size = ((size_t)cls + 1) * 8;
+    int total = (int)((page - SLAB_SLOTS_OFF) / slot_size);
+    int max_slots = SLAB_BITMAP_WORDS * (int)(8 * sizeof(unsigned long));
+    if (total > max_slots) {
+        total = max_slots;
+    }
+    s->total = total;
+    s->free_count = total;
+
+    // bits beyond the last slot are pre-set busy so the find-first-
+    // zero scan can never pick them
+    for (int w = 0; w < SLAB_BITMAP_WORDS; w++) {
+        s->bitmap[w] = 0;
+    }
+    for (int bit = total; bit < max_slots; bit++) {
+        s->bitmap[bit / 64] |= 1UL << (bit % 64);
+    }
+
+    s->next = slab_classes[cls].partial;
+    s->prev = NULL;
+    if (s->next != NULL) {
+        s->next->prev = s;
+    }
+    slab_classes[cls].partial = s;
+    return s;
+}
+
+/*
+ * Unlinks a slab page from its class's partial list; the caller holds
+ * the class lock
+ */
+static void slab_page_unlink(slab *s) {
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        slab_classes[s->class].partial = s->next;
+    }
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+}
+
+/*
+ * Serves one small allocation from a slab page of its size class:
+ * find the first zero bitmap bit, set it, return the slot's address
+ * Returns NULL if no page is available and none can be mapped, in
+ * which case the caller falls back to the boundary-tag heap
+ */
+static void* slab_alloc(size_t payload) {
+    int cls = (int)((payload + 7) / 8) - 1;
+    size_t slot_size = ((size_t)cls + 1) * 8;
+    pthread_mutex_lock(&slab_classes[cls].lock);
+
+    slab *s = slab_classes[cls].partial;
+    if (s == NULL) {
+        s = slab_page_new(cls);
+        if (s == NULL) {
+            pthread_mutex_unlock(&slab_classes[cls].lock);
+            return NULL;
+        }
+    }
+
+    // find-first-zero-bit over the slot bitmap
+    int slot = 0;
+    for (int w = 0; w < SLAB_BITMAP_WORDS; w++) {
+        unsigned long open = ~s->bitmap[w];
+        if (open != 0) {
+            int bit = __builtin_ctzl(open);
+            s->bitmap[w] |= 1UL << bit;
+            slot = w * (int)(8 * sizeof(unsigned long)) + bit;
+            break;
+        }
+    }
+    s->free_count -= 1;
+    if (s->free_count == 0) {
+        // full pages leave the list so allocation never rescans them
+        slab_page_unlink(s);
+    }
+    pthread_mutex_unlock(&slab_classes[cls].lock);
+
+    __atomic_add_fetch(&slab_bytes, slot_size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&slab_objects, 1, __ATOMIC_RELAXED);
+    return (char*)s + SLAB_SLOTS_OFF + (size_t)slot * slot_size;
+}
+
+/*
+ * Returns the slab page holding ptr, or NULL if ptr was not handed
+ * out by slab_alloc
+ * Only called for pointers that lie outside every arena, like
+ * mmap_hdr_of; slots never sit at the page boundary, so a direct
+ * mapping's payload can never be mistaken for a slab slot
+ */
+static slab* slab_of(void *ptr) {
+    size_t page = (size_t)getpagesize();
+    slab *s = (slab*)((size_t)ptr & ~(page - 1));
+    if ((void*)s == ptr || s->magic != SLAB_MAGIC) {
+        return NULL;
+    }
+    return s;
+}
+
+/*
+ * Returns one slot to its slab page: a bit clear, plus list surgery
+ * when the page changes state
+ * An empty page is unmapped unless it is the class's last partial
+ * page, so a ping-ponging workload does not pay mmap per cycle
+ */
+static int slab_free(slab *s, void *ptr) {
+    int cls = s->class;
+    size_t slot_size = ((size_t)cls + 1) * 8;
+    size_t off = (size_t)((char*)ptr - ((char*)s + SLAB_SLOTS_OFF));
+    if (off % slot_size != 0) {
+        return -1;
+    }
+    int slot = (int)(off / slot_size);
+    if (slot >= s->total) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&slab_classes[cls].lock);
+    unsigned long mask = 1UL << (slot % 64);
+    if ((s->bitmap[slot / 64] & mask) == 0) {
+        // the slot is already free - a double free
+        pthread_mutex_unlock(&slab_classes[cls].lock);
+        return -1;
+    }
+    s->bitmap[slot / 64] &= ~mask;
+    if (s->free_count == 0) {
+        // the page was full and off the list; it has a free slot again
+        s->next = slab_classes[cls].partial;
+        s->prev = NULL;
+        if (s->next != NULL) {
+            s->next->prev = s;
+        }
+        slab_classes[cls].partial = s;
+    }
+    s->free_count += 1;
+    if (s->free_count == s->total &&
+        (s->prev != NULL || s->next != NULL)) {
+        slab_page_unlink(s);
+        s->magic = 0;
+        munmap(s, (size_t)getpagesize());
+    }
+    pthread_mutex_unlock(&slab_classes[cls].lock);
+
+    __atomic_sub_fetch(&slab_bytes, slot_size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&slab_objects, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int arena_free_locked(arena *a, void *ptr);
+
+/*
+ * Pushes a block freed by a foreign thread onto the owning arena's
+ * lock-free stack; a single CAS, no lock, no coalescing work here
+ * The payload's first word becomes the stack link - the block is
+ * still marked busy, so nothing else will touch it
+ */
+static void remote_free_push(arena *a, void *ptr) {
+    void *head = __atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED);
+    do {
+        *(void**)ptr = head;
+    } while (!__atomic_compare_exchange_n(&a->remote_frees, &head, ptr,
+                                          1, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+/*
+ * Frees everything on the arena's remote stack; the caller holds the
+ * arena lock, so all coalescing stays on the draining thread
+ */
+static void arena_drain_remote(arena *a) {
+    void *head = __atomic_exchange_n(&a->remote_frees, NULL,
+                                     __ATOMIC_ACQUIRE);
+    while (head != NULL) {
+        void *next = *(void**)head;
+        arena_free_locked(a, head);
+        head = next;
+    }
+}
+
+/*
+ * Turns every deferred block into an ordinary free block and then
+ * merges runs of adjacent free blocks in one streaming sweep per
+ * region; the caller holds the arena lock
+ * Each queued block is released without looking at its neighbours, so
+ * the first pass touches only the queue; the second pass walks each
+ * region once in address order, which replaces the random-access
+ * header chasing of per-free coalescing with a linear scan
+ */
+static void arena_coalesce_locked(arena *a) {
+    a->mutations += 1;
+
+    // pass 1: release the queued blocks, neighbours untouched
+    void *head = a->deferred;
+    a->deferred = NULL;
+    a->deferred_count = 0;
+    while (head != NULL) {
+        void *next = *(void**)head;
+        blk_hdr *blk = (blk_hdr*)((char*)head - HDR_SIZE);
+        size_t size = blk_size(blk);
+        blk->size_status &= ~(size_t)1;
+        blk_hdr *footer = (blk_hdr*)((char*)blk + size - HDR_SIZE);
+        footer->size_status = size;
+        blk_hdr *after = (blk_hdr*)((char*)blk + size);
+        if (blk_size(after) != 0) {
+            after->size_status &= ~(size_t)2;
+        }
+        a->stats.bytes_busy -= size;
+        a->stats.busy_blocks -= 1;
+        bin_insert(a, blk);
+        head = next;
+    }
+
+    // pass 2: merge runs of adjacent free blocks, address order
+    for (region *r = a->regions; r != NULL; r = r->next) {
+        blk_hdr *cur = r->first;
+        while (cur->size_status != 1) {
+            size_t size = blk_size(cur);
+            if ((cur->size_status & 1) == 0) {
+                blk_hdr *next = (blk_hdr*)((char*)cur + size);
+                if ((next->size_status & 1) == 0) {
+                    bin_remove(a, cur);
+                    size_t run = size;
+                    while ((next->size_status & 1) == 0) {
+                        bin_remove(a, next);
+                        run += blk_size(next);
+                        next = (blk_hdr*)((char*)cur + run);
+                    }
+                    cur->size_status = run | (cur->size_status & 2);
+                    blk_hdr *footer =
+                        (blk_hdr*)((char*)cur + run - HDR_SIZE);
+                    footer->size_status = run;
+                    bin_insert(a, cur);
+                    size = run;
+                }
+            }
+            cur = (blk_hdr*)((char*)cur + size);
+        }
+    }
+}
+
+/*
+ * Queues one busy block for the next batch sweep instead of
+ * coalescing it; the caller holds the arena lock
+ * The payload's first word becomes the queue link and the second a
+ * key that catches a double free of a queued block, the same way the
+ * magazines do; hitting the queue threshold runs the sweep inline
+ */
+static int arena_defer_push(arena *a, void *ptr) {
+    blk_hdr *blk = (blk_hdr*)((char*)ptr - HDR_SIZE);
+    if ((blk->size_status & 1) == 0) {
+        return -1;
+    }
+    size_t *words = (size_t*)ptr;
+    if (words[1] == (DEFER_KEY ^ (size_t)ptr)) {
+        for (void *node = a->deferred; node != NULL;
+             node = *(void**)node) {
+            if (node == ptr) {
+                return -1;
+            }
+        }
+    }
+    *(void**)ptr = a->deferred;
+    words[1] = DEFER_KEY ^ (size_t)ptr;
+    a->deferred = ptr;
+    a->deferred_count += 1;
+    if (a->deferred_count >= DEFER_THRESHOLD) {
+        arena_coalesce_locked(a);
+    }
+    return 0;
+}
+
+/*
+ * Thread-local magazine cache
+ * Each thread keeps a small stack of recently freed blocks per exact
+ * size class (block sizes up to MAG_MAX_SIZE), so the hottest
+ * alloc/free pairs touch no lock and no atomic at all; the shared
+ * bins are only reached in batches of MAG_BATCH blocks when a
+ * magazine runs empty (refill) or full (flush)
+ * Cached blocks keep their busy bit, so they count as busy in the
+ * arena stats until they are flushed
+ */
+#define MAG_MAX_SIZE 128
+#define MAG_CLASSES ((int)((MAG_MAX_SIZE - MIN_BLK_SIZE) / 8) + 1)
+#define MAG_CAPACITY 64
+#define MAG_BATCH 32
+
+typedef struct magazine {
+    void *slots[MAG_CAPACITY];
+    int count;
+} magazine;
+
+static __thread magazine mags[MAG_CLASSES];
+
+/* Key written into a cached block's payload so a double free of a
+ * cached block is still caught even though its busy bit is set */
+#define MAG_KEY ((size_t)0x4d41475a)
+
+/* A destructor flushes each thread's magazines when the thread exits
+ * so its cached blocks are not stranded */
+static pthread_key_t mag_key;
+static pthread_once_t mag_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Maps a rounded block size to its magazine class, -1 if not cacheable
+ */
+static int mag_class(size_t size) {
+    if (size < MIN_BLK_SIZE || size > MAG_MAX_SIZE) {
+        return -1;
+    }
+    return (int)((size - MIN_BLK_SIZE) / 8);
+}
+
+/*
+ * Returns nblocks cached blocks to their arenas
+ * Consecutive blocks usually belong to the same arena, so the lock is
+ * held across the run instead of being taken per block
+ */
+static void mag_flush(magazine *mag, int nblocks) {
+    arena *locked = NULL;
+    while (nblocks > 0 && mag->count > 0) {
+        void *ptr = mag->slots[--mag->count];
+        arena *a = arena_for_ptr(ptr);
+        if (a != locked) {
+            if (locked != NULL) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&a->lock);
+            locked = a;
+        }
+        arena_free_locked(a, ptr);
+        nblocks -= 1;
+    }
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+static void mag_thread_exit(void *arg) {
+    magazine *m = (magazine*)arg;
+    for (int c = 0; c < MAG_CLASSES; c++) {
+        mag_flush(&m[c], m[c].count);
+    }
+}
+
+static void mag_key_create() {
+    pthread_key_create(&mag_key, mag_thread_exit);
+}
+
+/*
+ * Makes sure this thread's magazines are flushed when it exits
+ */
+static void mag_register_thread() {
+    pthread_once(&mag_key_once, mag_key_create);
+    if (pthread_getspecific(mag_key) == NULL) {
+        pthread_setspecific(mag_key, mags);
+    }
+}
+
+/*
+ * Lock-free fast path for Mem_Alloc: pops a cached block, if any
+ */
+static void* mag_pop(size_t size) {
+    int c = mag_class(size);
+    if (c < 0) {
+        return NULL;
+    }
+    // prefer the exact class, then the smallest cached block that
+    // fits; handing out a slightly larger cached block trades a
+    // bounded amount of slack (cacheable blocks are at most
+    // MAG_MAX_SIZE) for staying lock-free
+    for (int i = c; i < MAG_CLASSES; i++) {
+        if (mags[i].count > 0) {
+            void *ptr = mags[i].slots[--mags[i].count];
+            // clear the double-free key before handing the block out
+            *(size_t*)ptr = 0;
+            return ptr;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Primes an empty magazine with up to MAG_BATCH blocks carved from
+ * this thread's arena under a single lock hold
+ * The first block is returned straight to the caller - it is the best
+ * fit the arena had - and the rest just fill the magazine
+ */
+static void* mag_refill(size_t size) {
+    magazine *mag = &mags[mag_class(size)];
+    arena *a = arena_for_thread();
+    pthread_mutex_lock(&a->lock);
+    arena_drain_remote(a);
+    void *first = arena_alloc(a, size);
+    // prime the magazine only while the arena has memory to spare -
+    // in a small heap the cache must not starve ordinary allocations
+    for (int i = 0; i < MAG_BATCH - 1 && first != NULL &&
+         a->stats.bytes_free >= size * (size_t)(2 * MAG_BATCH); i++) {
+        void *extra = arena_alloc(a, size);
+        if (extra == NULL) {
+            break;
+        }
+        *(size_t*)extra = MAG_KEY ^ (size_t)extra;
+        mag->slots[mag->count++] = extra;
+    }
+    pthread_mutex_unlock(&a->lock);
+    if (first != NULL) {
+        mag_register_thread();
+    }
+    return first;
+}
+
+/*
+ * Lock-free fast path for Mem_Free
+ * Returns 1 if the block was cached, -1 if this is a double free of a
+ * cached block, 0 if the block is not cacheable
+ */
+static int mag_push(void *ptr) {
+    blk_hdr *blk = (blk_hdr*)((char*)ptr - HDR_SIZE);
+    size_t size = blk_size(blk);
+    int c = mag_class(size);
+    if (c < 0 || (blk->size_status & 1) == 0) {
+        return 0;
+    }
+    magazine *mag = &mags[c];
+    // a cached block keeps its busy bit, so the header check above
+    // would miss a double free; the payload key catches it
+    if (*(size_t*)ptr == (MAG_KEY ^ (size_t)ptr)) {
+        for (int i = 0; i < mag->count; i++) {
+            if (mag->slots[i] == ptr) {
+                return -1;
+            }
+        }
+    }
+    if (mag->count == MAG_CAPACITY) {
+        mag_flush(mag, MAG_BATCH);
+    }
+    *(size_t*)ptr = MAG_KEY ^ (size_t)ptr;
+    mag->slots[mag->count++] = ptr;
+    mag_register_thread();
+    return 1;
+}
+
+void* Mem_Alloc(size_t size) {
+    void *site = __builtin_return_address(0);
+
+    // return null if the size required is zero or we are uninitialized
+    if (size == 0 || num_arenas == 0) {
+        return NULL;
+    }
+
+    // very large requests get their own mapping and never touch the
+    // boundary-tag heap
+    if (mmap_threshold != 0 && size >= mmap_threshold) {
+        void *map = mmap_alloc(size);
+        if (map != NULL) {
+            prof_account(size, site);
+        }
+        MEM_TRACE("alloc", map, size);
+        return map;
+    }
+
+    // tiny requests come from the slab pages when enabled: no header,
+    // no rounding beyond the slot size, no free-list search
+    // if no page can be mapped, fall through to the ordinary path
+    if (slab_max != 0 && size <= slab_max) {
+        void *slot = slab_alloc(size);
+        if (slot != NULL) {
+            prof_account(size, site);
+            MEM_TRACE("alloc", slot, size);
+            return slot;
+        }
+    }
+
+    // Satisfy double word alignment
+    // Increment size to include the header (and the canary word in
+    // canary builds)
+    size += HDR_SIZE + CANARY_PAD;
+    // add padding if needed
+    if (size % 8 != 0) {
+        size = (size / 8 + 1) * 8;
+    }
+    // never create a block too small to be freed back onto a bin
+    if (size < MIN_BLK_SIZE) {
+        size = MIN_BLK_SIZE;
+    }
+
+    // small sizes: serve from this thread's magazine with no locking,
+    // refilling it in batch when it runs empty
+    if (mag_class(size) >= 0) {
+        void *cached = mag_pop(size);
+        if (cached == NULL) {
+            cached = mag_refill(size);
+        }
+        if (cached != NULL) {
+            canary_arm(cached);
+            prof_account(size, site);
+            MEM_TRACE("alloc", cached, size);
+            return cached;
+        }
+    }
+
+    // try this thread's arena first; if it cannot satisfy the request,
+    // fall over to the others rather than failing outright
+    arena *home = arena_for_thread();
+    void *ptr = NULL;
+    for (int i = 0; i < num_arenas && ptr == NULL; i++) {
+        arena *a = &arenas[(int)((home - arenas) + i) % num_arenas];
+        pthread_mutex_lock(&a->lock);
+        arena_drain_remote(a);
+        ptr = arena_alloc(a, size);
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    // a failed search may succeed once the deferred blocks coalesce
+    if (ptr == NULL && defer_coalescing) {
+        for (int i = 0; i < num_arenas && ptr == NULL; i++) {
+            arena *a = &arenas[(int)((home - arenas) + i) % num_arenas];
+            pthread_mutex_lock(&a->lock);
+            if (a->deferred_count > 0) {
+                arena_coalesce_locked(a);
+                ptr = arena_alloc(a, size);
+            }
+            pthread_mutex_unlock(&a->lock);
+        }
+    }
+
+    // every arena is exhausted: if growth is enabled, map a fresh
+    // region onto this thread's arena and retry instead of failing
+    if (ptr == NULL && growable) {
+        pthread_mutex_lock(&home->lock);
+        if (arena_grow(home, size) == 0) {
+            ptr = arena_alloc(home, size);
+        }
+        pthread_mutex_unlock(&home->lock);
+    }
+
+    if (ptr != NULL) {
+        canary_arm(ptr);
+        prof_account(size, site);
+    }
+    MEM_TRACE("alloc", ptr, size);
+    return ptr;
+}
+
+/*
+ * Frees one block back into its arena, coalescing with both
+ * neighbours; the caller holds the arena lock
+ * Coalescing is constant time: the previous-block bit says whether the
+ * predecessor is free, its footer says where it starts, and the
+ * successor's header says whether it is free
+ */
+static int arena_free_locked(arena *a, void *ptr) {
+    // the header sits one word before the payload
+    blk_hdr *blk = (blk_hdr*)((char*)ptr - HDR_SIZE);
+
+    // if the block is already free
+    if ((blk->size_status & 1) == 0) {
+        return -1;
+    }
+
+    // the span of the free block we are building up
+    blk_hdr *start = blk;
+    size_t size = blk_size(blk);
+    a->mutations += 1;
+
+    // the block is no longer busy
+    a->stats.bytes_busy -= size;
+    a->stats.busy_blocks -= 1;
+
+    // if the previous block is free, absorb it
+    // its footer (just before our header) tells us where it starts
+    if ((blk->size_status & 2) == 0) {
+        size_t prev_size = ((blk_hdr*)((char*)blk - HDR_SIZE))->size_status;
+        start = (blk_hdr*)((char*)blk - prev_size);
+        bin_remove(a, start);
+        size += prev_size;
+    }
+
+    // if the next block is free, absorb it as well
+    // the end mark is marked busy, so it never coalesces
+    blk_hdr *next = (blk_hdr*)((char*)blk + blk_size(blk));
+    if ((next->size_status & 1) == 0) {
+        bin_remove(a, next);
+        size += blk_size(next);
+    }
+
+    // write the merged header, keeping the previous-block bit
+    // (the predecessor of the merged span is always busy)
+    start->size_status = size | (start->size_status & 2);
+
+    // write the footer
+    blk_hdr *footer = (blk_hdr*)((char*)start + size - HDR_SIZE);
+    footer->size_status = size;
+
+    // tell the following block that its predecessor is now free
+    blk_hdr *after = (blk_hdr*)((char*)start + size);
+    if (blk_size(after) != 0) {
+        after->size_status &= ~(size_t)2;
+    }
+
+    // hand the merged block back to its bin
+    bin_insert(a, start);
+
+    // return 0 when success
+    return 0;
+}
+
+/*
+ * Trims a freshly allocated block down to an aligned payload of
+ * 'rounded' block bytes; the caller holds the arena lock
+ * The leading gap and the tail surplus are carved off as busy blocks
+ * and pushed through the ordinary free path, so they land in their
+ * bins and coalesce with their neighbours
+ * The block was sized so that a sufficiently large gap always exists
+ * when the payload needs moving, see Mem_AllocAligned
+ */
+static void* carve_aligned(arena *a, void *ptr, size_t rounded,
+                           size_t alignment) {
+    blk_hdr *blk = (blk_hdr*)((char*)ptr - HDR_SIZE);
+    size_t total = blk_size(blk);
+
+    // the aligned payload position, far enough in that the gap in
+    // front of it can stand alone as a free block
+    char *aligned = (char*)(((size_t)ptr + alignment - 1)
+                            & ~(alignment - 1));
+    while (aligned != (char*)ptr &&
+           (size_t)(aligned - (char*)ptr) < min_split) {
+        aligned += alignment;
+    }
+    size_t gap = (size_t)(aligned - (char*)ptr);
+
+    if (gap > 0) {
+        // the front becomes its own busy block and is freed back
+        blk_hdr *second = (blk_hdr*)(aligned - HDR_SIZE);
+        second->size_status = (total - gap) | 2 | 1;
+        blk->size_status = gap | (blk->size_status & 2) | 1;
+        a->stats.busy_blocks += 1;
+        arena_free_locked(a, ptr);
+        blk = second;
+        total -= gap;
+    }
+
+    // give the tail surplus back as well
+    if (total - rounded >= min_split) {
+        blk->size_status = rounded | (blk->size_status & 3);
+        blk_hdr *tail = (blk_hdr*)((char*)blk + rounded);
+        tail->size_status = (total - rounded) | 2 | 1;
+        a->stats.busy_blocks += 1;
+        arena_free_locked(a, (char*)tail + HDR_SIZE);
+    }
+    return (char*)blk + HDR_SIZE;
+}
+
+/*
+ * Function for allocating a block whose payload meets a power-of-two
+ * alignment stricter than the 8 bytes Mem_Alloc guarantees
+ * Arguments - size: payload bytes, alignment: a power of two
+ * Returns the aligned payload address on success, NULL on failure
+ * Over-allocates by the alignment plus one minimum block, then
+ * donates the leading gap and the tail surplus back as free blocks,
+ * so the busy block is sized to the request rather than the padding
+ * Served from the boundary-tag heap regardless of the mmap threshold
+ */
+void* Mem_AllocAligned(size_t size, size_t alignment) {
+    if (size == 0 || num_arenas == 0 ||
+        alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    // the ordinary path already aligns to 8
+    if (alignment <= 8) {
+        return Mem_Alloc(size);
+    }
+
+    // round the request exactly like Mem_Alloc does
+    size_t rounded = size + HDR_SIZE + CANARY_PAD;
+    if (rounded % 8 != 0) {
+        rounded = (rounded / 8 + 1) * 8;
+    }
+    if (rounded < MIN_BLK_SIZE) {
+        rounded = MIN_BLK_SIZE;
+    }
+
+    // room to shift the payload up to the next aligned address plus
+    // a gap big enough to stand alone as a free block
+    size_t ask = rounded + alignment + min_split;
+    if (ask < rounded) {
+        return NULL;
+    }
+
+    arena *home = arena_for_thread();
+    void *ptr = NULL;
+    for (int i = 0; i < num_arenas && ptr == NULL; i++) {
+        arena *a = &arenas[(int)((home - arenas) + i) % num_arenas];
+        pthread_mutex_lock(&a->lock);
+        arena_drain_remote(a);
+        ptr = arena_alloc(a, ask);
+        if (ptr != NULL) {
+            ptr = carve_aligned(a, ptr, rounded, alignment);
+        }
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    // every arena is exhausted: grow like Mem_Alloc does
+    if (ptr == NULL && growable) {
+        pthread_mutex_lock(&home->lock);
+        if (arena_grow(home, ask) == 0) {
+            ptr = arena_alloc(home, ask);
+            if (ptr != NULL) {
+                ptr = carve_aligned(home, ptr, rounded, alignment);
+            }
+        }
+        pthread_mutex_unlock(&home->lock);
+    }
+
+    canary_arm(ptr);
+    MEM_TRACE("alloc_aligned", ptr, rounded);
+    return ptr;
+}
+
+/*
+ * Slices one busy span into 'count' consecutive busy blocks of
+ * 'rounded' bytes each - the last one absorbs whatever slack
+ * arena_alloc could not split off - and stores the payload addresses
+ * The caller holds the arena lock
+ */
+static void batch_slice(arena *a, void *span, size_t rounded, int count,
+                        void **out) {
+    blk_hdr *blk = (blk_hdr*)((char*)span - HDR_SIZE);
+    size_t left = blk_size(blk);
+    size_t prev_bit = blk->size_status & 2;
+    for (int i = 0; i < count; i++) {
+        size_t piece = (i == count - 1) ? left : rounded;
+        blk->size_status = piece | prev_bit | 1;
+        out[i] = (char*)blk + HDR_SIZE;
+        blk = (blk_hdr*)((char*)blk + piece);
+        left -= piece;
+        // every sub-block after the first follows a busy one
+        prev_bit = 2;
+    }
+    // arena_alloc counted the span as one busy block
+    a->stats.busy_blocks += count - 1;
+    a->mutations += 1;
+}
+
+/*
+ * Function for allocating 'count' blocks of 'size' bytes in one pass
+ * Arguments - size: payload bytes per block, count: how many blocks,
+ *             out: receives the 'count' payload addresses
+ * Returns 0 on success and -1 on failure
+ * The whole batch is carved out of a single free block front to
+ * back, so one free-list search pays for all the blocks and the
+ * payloads come out physically adjacent - far cheaper, and friendlier
+ * to the cache, than calling Mem_Alloc in a loop when a loader fills
+ * thousands of equal row buffers
+ * When no single free block can hold the batch this falls back to
+ * per-block allocation, undoing the partial batch if one fails
+ */
+int Mem_AllocBatch(size_t size, int count, void **out) {
+    void *site = __builtin_return_address(0);
+    if (size == 0 || count <= 0 || out == NULL || num_arenas == 0) {
+        return -1;
+    }
+
+    // round one block exactly like Mem_Alloc does
+    size_t rounded = size + HDR_SIZE + CANARY_PAD;
+    if (rounded % 8 != 0) {
+        rounded = (rounded / 8 + 1) * 8;
+    }
+    if (rounded < MIN_BLK_SIZE) {
+        rounded = MIN_BLK_SIZE;
+    }
+    size_t total = rounded * (size_t)count;
+    if (total / (size_t)count != rounded) {
+        return -1;
+    }
+
+    // one search for the whole span, then slice it up under the same
+    // lock acquisition
+    arena *home = arena_for_thread();
+    void *span = NULL;
+    for (int i = 0; i < num_arenas && span == NULL; i++) {
+        arena *a = &arenas[(int)((home - arenas) + i) % num_arenas];
+        pthread_mutex_lock(&a->lock);
+        arena_drain_remote(a);
+        span = arena_alloc(a, total);
+        if (span != NULL) {
+            batch_slice(a, span, rounded, count, out);
+        }
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    // every arena is exhausted: grow like Mem_Alloc does
+    if (span == NULL && growable) {
+        pthread_mutex_lock(&home->lock);
+        if (arena_grow(home, total) == 0) {
+            span = arena_alloc(home, total);
+            if (span != NULL) {
+                batch_slice(home, span, rounded, count, out);
+            }
+        }
+        pthread_mutex_unlock(&home->lock);
+    }
+
+    if (span != NULL) {
+        for (int i = 0; i < count; i++) {
+            canary_arm(out[i]);
+        }
+        prof_account(total, site);
+        MEM_TRACE("alloc_batch", span, total);
+        return 0;
+    }
+
+    // no single block fits the whole batch - go one by one
+    for (int i = 0; i < count; i++) {
+        out[i] = Mem_Alloc(size);
+        if (out[i] == NULL) {
+            while (i-- > 0) {
+                Mem_Free(out[i]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Releases one block from the quarantine back into its arena,
+ * reporting a use-after-free write if the poison was disturbed while
+ * the block was parked
+ */
+static void quar_release(void *ptr) {
+    blk_hdr *blk = (blk_hdr*)((char*)ptr - HDR_SIZE);
+    size_t payload = blk_size(blk) - HDR_SIZE;
+    size_t *words = (size_t*)ptr;
+
+    char *scan = (char*)ptr + 2 * sizeof(size_t);
+    for (size_t i = 0; i + 2 * sizeof(size_t) < payload; i++) {
+        if ((unsigned char)scan[i] != QUAR_POISON) {
+            fprintf(stderr, "mem: use-after-free write in freed block "
+                    "%p (payload offset %zu)\n",
+                    ptr, i + 2 * sizeof(size_t));
+            break;
+        }
+    }
+    words[1] = 0;
+
+    arena *a = arena_for_ptr(ptr);
+    if (a == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&a->lock);
+    arena_free_locked(a, ptr);
+    pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * Poisons one freed block and parks it in the quarantine ring,
+ * releasing the block it displaces; returns 0, or -1 for a double
+ * free (including of a block still parked)
+ * The busy bit stays set while parked, so the neighbours cannot
+ * coalesce into the poisoned span and the payload keeps its poison
+ * until the block really frees
+ */
+static int quar_push_block(void *ptr) {
+    blk_hdr *blk = (blk_hdr*)((char*)ptr - HDR_SIZE);
+    size_t *words = (size_t*)ptr;
+    if ((blk->size_status & 1) == 0 ||
+        words[1] == (QUAR_KEY ^ (size_t)ptr)) {
+        return -1;
+    }
+
+    size_t payload = blk_size(blk) - HDR_SIZE;
+    if (payload > 2 * sizeof(size_t)) {
+        memset((char*)ptr + 2 * sizeof(size_t), QUAR_POISON,
+               payload - 2 * sizeof(size_t));
+    }
+    words[1] = QUAR_KEY ^ (size_t)ptr;
+
+    pthread_mutex_lock(&quar_lock);
+    void *evict = quar_ring[quar_pos];
+    quar_ring[quar_pos] = ptr;
+    quar_pos = (quar_pos + 1) % QUAR_BLOCKS;
+    pthread_mutex_unlock(&quar_lock);
+    if (evict != NULL) {
+        quar_release(evict);
+    }
+    return 0;
+}
+
+/*
+ * Empties both quarantine rings - parked blocks free for real and
+ * parked mappings unmap
+ */
+static void quar_drain(void) {
+    void *blocks[QUAR_BLOCKS];
+    void *bases[QUAR_MAPS];
+    size_t lens[QUAR_MAPS];
+
+    pthread_mutex_lock(&quar_lock);
+    for (int i = 0; i < QUAR_BLOCKS; i++) {
+        blocks[i] = quar_ring[i];
+        quar_ring[i] = NULL;
+    }
+    for (int i = 0; i < QUAR_MAPS; i++) {
+        bases[i] = quar_maps[i].base;
+        lens[i] = quar_maps[i].len;
+        quar_maps[i].base = NULL;
+    }
+    pthread_mutex_unlock(&quar_lock);
+
+    for (int i = 0; i < QUAR_BLOCKS; i++) {
+        if (blocks[i] != NULL) {
+            quar_release(blocks[i]);
+        }
+    }
+    for (int i = 0; i < QUAR_MAPS; i++) {
+        if (bases[i] != NULL) {
+            munmap(bases[i], lens[i]);
+        }
+    }
+}
+
+/*
+ * Function for freeing up a previously allocated block
+ * Argument - ptr: Address of the block to be freed up
+ * Returns 0 on success
+ * Returns -1 on failure
+ * Here is what this function accomplishes
+ * - Return -1 if ptr is NULL
+ * - Return -1 if ptr is not 8 byte aligned or if the block is already freed
+ * - Small blocks go into this thread's magazine with no locking; a
+ *   full magazine is flushed back to the arenas in one batch
+ * - Otherwise mark the block as free and coalesce with free neighbours
+ */
+int Mem_Free(void *ptr) {
+    // if the ptr is NULL
+    if (ptr == NULL) {
+        return -1;
+    }
+
+    // if the ptr is not 8 byte aligned
+    if (((unsigned long int)ptr & 7) != 0) {
+        return -1;
+    }
+
+    // route the pointer back to the arena that owns it; pointers
+    // outside every arena are slab slots or direct mappings
+    arena *a = arena_for_ptr(ptr);
+    if (a == NULL) {
+        slab *s = slab_of(ptr);
+        if (s != NULL) {
+            int result = slab_free(s, ptr);
+            if (result == 0) {
+                MEM_TRACE("free", ptr, 0);
+            }
+            return result;
+        }
+        int result = mmap_free(ptr);
+        if (result == 0) {
+            MEM_TRACE("free", ptr, 0);
+        }
+        return result;
+    }
+
+    // in canary builds a clobbered canary word means the payload
+    // overran its block - refuse to recycle it
+    if (canary_check_busy(ptr) != 0) {
+        return -1;
+    }
+
+    // guard mode: poison the payload and park the block, so a stale
+    // read hits poison and a stale write is reported when the block
+    // finally leaves the quarantine
+    if (debug_guards) {
+        int parked = quar_push_block(ptr);
+        if (parked == 0) {
+            MEM_TRACE("free", ptr, 0);
+        }
+        return parked;
+    }
+
+    // small busy blocks are cached locally instead of hitting the arena
+    int cached = mag_push(ptr);
+    if (cached == 1) {
+        MEM_TRACE("free", ptr, 0);
+        return 0;
+    }
+    if (cached == -1) {
+        return -1;
+    }
+
+    // a free that crosses arenas goes onto the owner's lock-free
+    // queue; the owner picks up the coalescing work at its next
+    // allocation and this thread pays only one CAS
+    if (my_arena >= 0 && &arenas[my_arena] != a) {
+        blk_hdr *blk = (blk_hdr*)((char*)ptr - HDR_SIZE);
+        if ((blk->size_status & 1) == 0) {
+            return -1;
+        }
+        remote_free_push(a, ptr);
+        MEM_TRACE("free", ptr, 0);
+        return 0;
+    }
+
+    pthread_mutex_lock(&a->lock);
+    int result = defer_coalescing ? arena_defer_push(a, ptr)
+                                  : arena_free_locked(a, ptr);
+    pthread_mutex_unlock(&a->lock);
+
+    if (result == 0) {
+        MEM_TRACE("free", ptr, 0);
+    }
+    return result;
+}
+
+/*
+ * Sorts a pointer array by address with an in-place shell sort
+ * (libc qsort may allocate, which would re-enter the heap this very
+ * call is about to mutate)
+ */
+static void batch_sort(void **ptrs, int count) {
+    for (int gap = count / 2; gap > 0;
+         gap = (gap == 2) ? 1 : gap * 5 / 11) {
+        for (int i = gap; i < count; i++) {
+            void *key = ptrs[i];
+            int j = i;
+            while (j >= gap && ptrs[j - gap] > key) {
+                ptrs[j] = ptrs[j - gap];
+                j -= gap;
+            }
+            ptrs[j] = key;
+        }
+    }
+}
+
+/*
+ * Function for freeing 'count' previously allocated blocks in one pass
+ * Arguments - ptrs: the payload addresses (the array is sorted in
+ *             place), count: how many
+ * Returns 0 if every block was freed, -1 if any pointer was rejected
+ * (the rest of the batch is still freed)
+ * The pointers are sorted by address and every run of physically
+ * adjacent busy blocks is merged into one block before it is freed,
+ * so the free lists and boundary tags are touched once per run
+ * instead of once per block - the teardown mirror of Mem_AllocBatch
+ */
+int Mem_FreeBatch(void **ptrs, int count) {
+    if (ptrs == NULL || count <= 0) {
+        return -1;
+    }
+    batch_sort(ptrs, count);
+
+    int result = 0;
+    int i = 0;
+    while (i < count) {
+        void *ptr = ptrs[i];
+        if (ptr == NULL || ((unsigned long int)ptr & 7) != 0) {
+            result = -1;
+            i++;
+            continue;
+        }
+
+        // slab slots and direct mappings are never adjacent in the
+        // boundary-tag sense - free them one at a time
+        arena *a = arena_for_ptr(ptr);
+        if (a == NULL) {
+            if (Mem_Free(ptr) != 0) {
+                result = -1;
+            }
+            i++;
+            continue;
+        }
+
+        pthread_mutex_lock(&a->lock);
+        blk_hdr *head = (blk_hdr*)((char*)ptr - HDR_SIZE);
+        if ((head->size_status & 1) == 0 || canary_check_busy(ptr) != 0) {
+            pthread_mutex_unlock(&a->lock);
+            result = -1;
+            i++;
+            continue;
+        }
+
+        // absorb the following pointers while they are physically
+        // adjacent busy blocks: the whole run frees as one block,
+        // paying one bin insert and one coalesce for all of it
+        size_t run = blk_size(head);
+        int merged = 0;
+        while (i + merged + 1 < count) {
+            void *next_ptr = ptrs[i + merged + 1];
+            if ((char*)next_ptr != (char*)head + run + HDR_SIZE) {
+                break;
+            }
+            blk_hdr *next = (blk_hdr*)((char*)next_ptr - HDR_SIZE);
+            if ((next->size_status & 1) == 0 ||
+                canary_check_busy(next_ptr) != 0) {
+                break;
+            }
+            run += blk_size(next);
+            merged++;
+        }
+        head->size_status = run | (head->size_status & 2) | 1;
+        a->stats.busy_blocks -= merged;
+        if (arena_free_locked(a, ptr) != 0) {
+            result = -1;
+        }
+        pthread_mutex_unlock(&a->lock);
+        MEM_TRACE("free_batch", ptr, run);
+        i += merged + 1;
+    }
+    return result;
+}
+
+/*
+ * A fixed-size object pool, carved out of the heap as one ordinary
+ * busy block: the descriptor sits at the front and the slots follow,
+ * with no blk_hdr per object
+ * Returned slots chain through their own first word in LIFO order,
+ * so allocation is a list pop (or a cursor bump for a never-used
+ * slot) and free is a list push - no search, no split, and the most
+ * recently freed object, still warm in cache, is reused first
+ */
+struct mem_pool {
+    void *free;                 // LIFO chain of returned slots
+    char *cursor;               // first never-used slot
+    char *limit;                // one past the last slot
+    size_t slot;                // slot size in bytes
+};
+
+/*
+ * Function for creating a pool of 'capacity' objects of 'obj_size'
+ * bytes each
+ * Returns the pool handle on success, NULL on failure
+ * The pool occupies one contiguous block, so creating it costs one
+ * ordinary allocation and destroying it one ordinary free
+ * A pool handle is meant to be owned by one subsystem; unlike the
+ * Mem_Alloc paths it takes no lock, so callers sharing one across
+ * threads must serialize around it themselves
+ */
+mem_pool* Mem_PoolCreate(size_t obj_size, int capacity) {
+    if (obj_size == 0 || capacity <= 0 || num_arenas == 0) {
+        return NULL;
+    }
+    // a free slot stores the chain link in its first word
+    size_t slot = obj_size < sizeof(void*) ? sizeof(void*) : obj_size;
+    if (slot % 8 != 0) {
+        slot = (slot / 8 + 1) * 8;
+    }
+    size_t total = sizeof(mem_pool) + slot * (size_t)capacity;
+    if ((total - sizeof(mem_pool)) / slot != (size_t)capacity) {
+        return NULL;
+    }
+    mem_pool *pool = Mem_Alloc(total);
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->free = NULL;
+    pool->cursor = (char*)(pool + 1);
+    pool->limit = pool->cursor + slot * (size_t)capacity;
+    pool->slot = slot;
+    return pool;
+}
+
+/*
+ * Function for taking one object from the pool
+ * Returns the object address, or NULL when the pool is exhausted
+ */
+void* Mem_PoolAlloc(mem_pool *pool) {
+    if (pool == NULL) {
+        return NULL;
+    }
+    // the most recently returned slot first - it is the hottest one
+    if (pool->free != NULL) {
+        void *ptr = pool->free;
+        pool->free = *(void**)ptr;
+        return ptr;
+    }
+    if (pool->cursor < pool->limit) {
+        void *ptr = pool->cursor;
+        pool->cursor += pool->slot;
+        return ptr;
+    }
+    return NULL;
+}
+
+/*
+ * Function for returning one object to the pool
+ * Returns 0 on success, -1 if ptr is not a slot of this pool
+ */
+int Mem_PoolFree(mem_pool *pool, void *ptr) {
+    if (pool == NULL || ptr == NULL) {
+        return -1;
+    }
+    char *slots = (char*)(pool + 1);
+    if ((char*)ptr < slots || (char*)ptr >= pool->cursor ||
+        ((size_t)((char*)ptr - slots)) % pool->slot != 0) {
+        return -1;
+    }
+    *(void**)ptr = pool->free;
+    pool->free = ptr;
+    return 0;
+}
+
+/*
+ * Function for destroying a pool and giving its block back to the
+ * heap; every object handed out becomes invalid with it
+ * Returns 0 on success, -1 on failure
+ */
+int Mem_PoolDestroy(mem_pool *pool) {
+    return Mem_Free(pool);
+}
+
+/*
+ * Function for resizing a previously allocated block
+ * Arguments - ptr: address of the block to resize, size: new payload
+ * size in bytes
+ * Returns the address of the resized block on success, NULL on failure
+ * (the original block is left untouched on failure)
+ * A NULL ptr behaves like Mem_Alloc(size); a zero size frees the block
+ * Growth is attempted in place first by absorbing a free successor
+ * with the same split logic Mem_Alloc uses, and shrinking gives the
+ * surplus back as a free block; only when the successor cannot cover
+ * the request does this fall back to allocate-copy-free
+ */
+void* Mem_Realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return Mem_Alloc(size);
+    }
+    if (size == 0) {
+        Mem_Free(ptr);
+        return NULL;
+    }
+    if (((unsigned long int)ptr & 7) != 0) {
+        return NULL;
+    }
+    arena *a = arena_for_ptr(ptr);
+    if (a == NULL) {
+        // a slab slot never grows in place: its slot size is the whole
+        // budget, anything bigger is allocate-copy-free
+        slab *s = slab_of(ptr);
+        if (s != NULL) {
+            size_t slot_size = ((size_t)s->class + 1) * 8;
+            if (size <= slot_size) {
+                return ptr;
+            }
+            void *fresh = Mem_Alloc(size);
+            if (fresh == NULL) {
+                return NULL;
+            }
+            memcpy(fresh, ptr, slot_size);
+            slab_free(s, ptr);
+            MEM_TRACE("realloc", fresh, size);
+            return fresh;
+        }
+        // a guarded mapping is resized by allocate-copy-free; its
+        // payload runs flush to the guard page
+        guard_hdr *ghdr = guard_hdr_of(ptr);
+        if (ghdr != NULL) {
+            size_t old_payload = (size_t)((char*)ghdr->base
+                                          + ghdr->map_size
+                                          - (size_t)getpagesize()
+                                          - (char*)ptr);
+            void *fresh = Mem_Alloc(size);
+            if (fresh == NULL) {
+                return NULL;
+            }
+            memcpy(fresh, ptr, size < old_payload ? size : old_payload);
+            mmap_free(ptr);
+            MEM_TRACE("realloc", fresh, size);
+            return fresh;
+        }
+        // a direct mapping is resized by allocate-copy-free
+        mmap_hdr *hdr = mmap_hdr_of(ptr);
+        if (hdr == NULL) {
+            return NULL;
+        }
+        size_t old_payload = hdr->map_size - sizeof(mmap_hdr);
+        if (size <= old_payload &&
+            old_payload - size < (size_t)getpagesize()) {
+            return ptr;
+        }
+        void *fresh = Mem_Alloc(size);
+        if (fresh == NULL) {
+            return NULL;
+        }
+        memcpy(fresh, ptr, size < old_payload ? size : old_payload);
+        mmap_free(ptr);
+        return fresh;
+    }
+
+    // round the request exactly like Mem_Alloc does
+    size += HDR_SIZE + CANARY_PAD;
+    if (size % 8 != 0) {
+        size = (size / 8 + 1) * 8;
+    }
+    if (size < MIN_BLK_SIZE) {
+        size = MIN_BLK_SIZE;
+    }
+
+    pthread_mutex_lock(&a->lock);
+
+    blk_hdr *blk = (blk_hdr*)((char*)ptr - HDR_SIZE);
+    if ((blk->size_status & 1) == 0) {
+        pthread_mutex_unlock(&a->lock);
+        return NULL;
+    }
+    size_t cur_size = blk_size(blk);
+
+    // try to grow in place by absorbing a free successor block
+    if (size > cur_size) {
+        blk_hdr *next = (blk_hdr*)((char*)blk + cur_size);
+        if ((next->size_status & 1) == 0 &&
+            cur_size + blk_size(next) >= size) {
+            size_t next_size = blk_size(next);
+            bin_remove(a, next);
+            blk->size_status = (cur_size + next_size)
+                               | (blk->size_status & 3);
+            a->stats.bytes_busy += next_size;
+            if (a->stats.bytes_busy > a->stats.peak_bytes_busy) {
+                a->stats.peak_bytes_busy = a->stats.bytes_busy;
+            }
+            // the block after the absorbed one now has a busy
+            // predecessor (the split below may free part of it again)
+            blk_hdr *after = (blk_hdr*)((char*)blk + cur_size + next_size);
+            if (blk_size(after) != 0) {
+                after->size_status |= 2;
+            }
+            cur_size += next_size;
+        }
+    }
+
+    // resized in place (possibly after absorbing): carve any surplus
+    // off as a busy block and push it through the ordinary free path
+    // so it lands in a bin and coalesces forward
+    if (size <= cur_size) {
+        // advance the ever-touched mark like arena_alloc does: the
+        // caller may dirty everything up to the absorbed end, and the
+        // surplus carve below writes its index links right past the
+        // shrunk block (Mem_Calloc relies on everything above the
+        // mark still being untouched mmap zeros)
+        region *reg = region_of(a, blk);
+        char *touched = (char*)blk + cur_size;
+        if (cur_size - size >= min_split) {
+            size_t rem_size = cur_size - size;
+            size_t links = (rem_size <= BIN_MAX_SIZE) ? sizeof(free_blk)
+                                                      : sizeof(tree_blk);
+            touched = (char*)blk + size + HDR_SIZE + links;
+        }
+        if (reg != NULL && touched > reg->high_water) {
+            reg->high_water = touched;
+        }
+
+        if (cur_size - size >= min_split) {
+            blk->size_status = size | (blk->size_status & 3);
+            blk_hdr *rem = (blk_hdr*)((char*)blk + size);
+            rem->size_status = (cur_size - size) | 2 | 1;
+            a->stats.busy_blocks += 1;
+            arena_free_locked(a, (char*)rem + HDR_SIZE);
+        }
+        a->mutations += 1;
+        canary_arm(ptr);
+        pthread_mutex_unlock(&a->lock);
+        MEM_TRACE("realloc", ptr, size);
+        return ptr;
+    }
+
+    pthread_mutex_unlock(&a->lock);
+
+    // no room to grow in place - allocate, copy, free
+    void *fresh = Mem_Alloc(size - HDR_SIZE);
+    if (fresh == NULL) {
+        return NULL;
+    }
+    memcpy(fresh, ptr, cur_size - HDR_SIZE);
+    Mem_Free(ptr);
+    MEM_TRACE("realloc", fresh, size);
+    return fresh;
+}
+
+/*
+ * Function for allocating a zeroed array of n elements of 'size' bytes
+ * Returns address of the allocated block on success, NULL on failure
+ * (including multiplication overflow)
+ * The heap is anonymous mmap memory, so pages above the arena's
+ * high-water mark have never been written and are already zero; a
+ * block carved entirely from such memory skips the memset, and one
+ * whose first words held old free-list links clears just that prefix
+ * Recycled blocks are cleared in full, and the thread magazines are
+ * bypassed because their cached blocks are always recycled
+ */
+void* Mem_Calloc(size_t n, size_t size) {
+    void *site = __builtin_return_address(0);
+    size_t payload = n * size;
+    if (n != 0 && payload / n != size) {
+        return NULL;
+    }
+    if (payload == 0 || num_arenas == 0) {
+        return NULL;
+    }
+
+    // large requests get a fresh anonymous mapping, which the kernel
+    // hands out already zeroed - no memset at all
+    if (mmap_threshold != 0 && payload >= mmap_threshold) {
+        void *map = mmap_alloc(payload);
+        if (map != NULL) {
+            prof_account(payload, site);
+        }
+        MEM_TRACE("calloc", map, payload);
+        return map;
+    }
+
+    // slab slots are recycled without any bookkeeping of what was
+    // written in them, so they are always cleared in full
+    if (slab_max != 0 && payload <= slab_max) {
+        void *slot = slab_alloc(payload);
+        if (slot != NULL) {
+            memset(slot, 0, payload);
+            prof_account(payload, site);
+            MEM_TRACE("calloc", slot, payload);
+            return slot;
+        }
+    }
+
+    // round the request exactly like Mem_Alloc does
+    size_t blksz = payload + HDR_SIZE + CANARY_PAD;
+    if (blksz % 8 != 0) {
+        blksz = (blksz / 8 + 1) * 8;
+    }
+    if (blksz < MIN_BLK_SIZE) {
+        blksz = MIN_BLK_SIZE;
+    }
+
+    arena *home = arena_for_thread();
+    void *ptr = NULL;
+    size_t dirty = 0;
+    for (int i = 0; i < num_arenas && ptr == NULL; i++) {
+        arena *a = &arenas[(int)((home - arenas) + i) % num_arenas];
+        pthread_mutex_lock(&a->lock);
+        arena_drain_remote(a);
+        ptr = arena_alloc(a, blksz);
+        if (ptr != NULL) {
+            dirty = a->last_alloc_dirty;
+        }
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    // a failed search may succeed once the deferred blocks coalesce
+    if (ptr == NULL && defer_coalescing) {
+        for (int i = 0; i < num_arenas && ptr == NULL; i++) {
+            arena *a = &arenas[(int)((home - arenas) + i) % num_arenas];
+            pthread_mutex_lock(&a->lock);
+            if (a->deferred_count > 0) {
+                arena_coalesce_locked(a);
+                ptr = arena_alloc(a, blksz);
+                if (ptr != NULL) {
+                    dirty = a->last_alloc_dirty;
+                }
+            }
+            pthread_mutex_unlock(&a->lock);
+        }
+    }
+
+    // exhausted: grow the home arena just like Mem_Alloc does
+    if (ptr == NULL && growable) {
+        pthread_mutex_lock(&home->lock);
+        if (arena_grow(home, blksz) == 0) {
+            ptr = arena_alloc(home, blksz);
+            dirty = home->last_alloc_dirty;
+        }
+        pthread_mutex_unlock(&home->lock);
+    }
+
+    if (ptr == NULL) {
+        return NULL;
+    }
+    if (dirty > payload) {
+        dirty = payload;
+    }
+    if (dirty > 0) {
+        memset(ptr, 0, dirty);
+    }
+    canary_arm(ptr);
+    prof_account(blksz, site);
+    MEM_TRACE("calloc", ptr, blksz);
+    return ptr;
+}
+
+/*
+ * Function for reading out the allocator counters
+ * Argument - stats_out: filled in with a snapshot of the counters
+ * Everything is maintained incrementally by Mem_Alloc/Mem_Free; the
+ * only work done here is locating the largest free block, which sits
+ * in the highest non-empty bin, so no block-list traversal is needed
+ */
+void Mem_GetStats(mem_stats *stats_out) {
+    memset(stats_out, 0, sizeof(*stats_out));
+    stats_out->bytes_busy = __atomic_load_n(&mmap_bytes, __ATOMIC_RELAXED);
+    stats_out->busy_blocks = __atomic_load_n(&mmap_blocks,
+                                             __ATOMIC_RELAXED);
+    stats_out->bytes_busy += __atomic_load_n(&slab_bytes,
+                                             __ATOMIC_RELAXED);
+    stats_out->busy_blocks += __atomic_load_n(&slab_objects,
+                                              __ATOMIC_RELAXED);
+    for (int i = 0; i < num_arenas; i++) {
+        arena *a = &arenas[i];
+        pthread_mutex_lock(&a->lock);
+        stats_out->bytes_busy += a->stats.bytes_busy;
+        stats_out->bytes_free += a->stats.bytes_free;
+        stats_out->busy_blocks += a->stats.busy_blocks;
+        stats_out->free_blocks += a->stats.free_blocks;
+        stats_out->peak_bytes_busy += a->stats.peak_bytes_busy;
+        // the arena's largest free block is the rightmost tree node,
+        // or the highest non-empty exact bin if the tree is empty
+        size_t largest = 0;
+        if (a->tree != NULL) {
+            tree_blk *node = a->tree;
+            while (node->right != NULL) {
+                node = node->right;
+            }
+            largest = tree_key(node);
+        } else {
+            for (int idx = NUM_BINS - 1; idx >= 0; idx--) {
+                if (a->bins[idx] != NULL) {
+                    largest = MIN_BLK_SIZE + (size_t)idx * 8;
+                    break;
+                }
+            }
+        }
+        if (largest > stats_out->largest_free_block) {
+            stats_out->largest_free_block = largest;
+        }
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+/*
+ * Drops the page-aligned span strictly between one free block's
+ * header/tree node and its footer, and returns the bytes released
+ */
+static size_t trim_block(blk_hdr *blk, size_t size) {
+    size_t page = (size_t)getpagesize();
+    char *lo = (char*)blk + HDR_SIZE + sizeof(tree_blk);
+    char *hi = (char*)blk + size - HDR_SIZE;
+    lo = (char*)(((size_t)lo + page - 1) & ~(page - 1));
+    hi = (char*)((size_t)hi & ~(page - 1));
+    if (lo >= hi) {
+        return 0;
+    }
+    if (madvise(lo, (size_t)(hi - lo), MADV_DONTNEED) != 0) {
+        return 0;
+    }
+    return (size_t)(hi - lo);
+}
+
+/*
+ * Trims every block in the subtree at root larger than threshold,
+ * including the duplicate chains; subtrees whose keys cannot exceed
+ * the threshold are pruned from the walk
+ */
+static size_t tree_trim(tree_blk *root, size_t threshold) {
+    if (root == NULL) {
+        return 0;
+    }
+    size_t released = 0;
+    size_t key = tree_key(root);
+    if (key > threshold) {
+        released += tree_trim(root->left, threshold);
+        for (tree_blk *node = root; node != NULL; node = node->eq_next) {
+            released += trim_block((blk_hdr*)((char*)node - HDR_SIZE),
+                                   key);
+        }
+    }
+    released += tree_trim(root->right, threshold);
+    return released;
+}
+
+/*
+ * Function for returning the slack inside large free blocks to the OS
+ * Argument - threshold: only free blocks larger than this many bytes
+ *            are considered (0 trims every block with a page to spare)
+ * Returns the number of bytes released
+ * For each candidate the page-aligned span strictly between the
+ * header/tree node and the footer is madvise(MADV_DONTNEED)d, so the
+ * block stays intact in its index and in the address order walk; the
+ * kernel just drops the backing pages until they are touched again
+ * Only the size treap is walked - blocks in the exact bins are far
+ * below a page and can never contain a trimmable span
+ * Dropped pages read back as zeros, which the calloc high-water
+ * optimization already treats as dirty, so nothing else needs updating
+ */
+size_t Mem_Trim(size_t threshold) {
+    size_t released = 0;
+    for (int i = 0; i < num_arenas; i++) {
+        arena *a = &arenas[i];
+        pthread_mutex_lock(&a->lock);
+        released += tree_trim(a->tree, threshold);
+        pthread_mutex_unlock(&a->lock);
+    }
+    return released;
+}
+
+/*
+ * Incremental integrity-check cursor: the arena, region and block
+ * where the previous Mem_Validate call stopped, plus that arena's
+ * mutation count at the time - if the arena has changed since, the
+ * saved block pointer may point mid-block, so the walk re-anchors at
+ * the start of its region instead of reporting phantom corruption
+ */
+static int val_arena = 0;
+static region *val_region = NULL;
+static blk_hdr *val_blk = NULL;
+static size_t val_mutations = 0;
+
+/*
+ * Checks one block's boundary tags; the caller holds the arena lock
+ * Returns 0 if they are consistent and -1 if they are corrupted
+ */
+static int val_block(region *r, blk_hdr *blk) {
+    size_t size = blk_size(blk);
+    // a zero, unaligned or off-the-end size means the header itself
+    // has been overwritten
+    if (size == 0 || size % 8 != 0 ||
+        (char*)blk + size > r->limit - HDR_SIZE) {
+        return -1;
+    }
+    // the successor's previous-block bit must mirror our busy bit
+    // (the end mark never carries it)
+    blk_hdr *next = (blk_hdr*)((char*)blk + size);
+    if (next->size_status != 1 &&
+        ((next->size_status & 2) != 0) != ((blk->size_status & 1) != 0)) {
+        return -1;
+    }
+    // a free block's footer must agree with its header
+    if ((blk->size_status & 1) == 0 &&
+        ((blk_hdr*)((char*)next - HDR_SIZE))->size_status != size) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function for checking the heap's boundary tags incrementally
+ * Argument - max_blocks: how many blocks to check this call; each
+ *            call resumes where the previous one stopped, so the
+ *            check can run from an event loop without a latency
+ *            spike (non-positive sweeps the whole heap at once)
+ * Returns 0 if everything checked is consistent, -1 on corruption
+ * Slab pages and direct mappings have no boundary tags and are not
+ * part of the walk
+ */
+int Mem_Validate(int max_blocks) {
+    if (num_arenas == 0) {
+        return 0;
+    }
+    long budget = (long)max_blocks;
+    if (val_arena >= num_arenas) {
+        val_arena = 0;
+        val_region = NULL;
+    }
+
+    // one trip around all the arenas at most, so a non-positive
+    // budget is exactly one full sweep
+    for (int swept = 0; swept < num_arenas; swept++) {
+        arena *a = &arenas[val_arena];
+        pthread_mutex_lock(&a->lock);
+
+        // re-anchor the cursor: find the saved region in the list
+        // (it may be gone after a restore) and trust the saved block
+        // only if the arena has not changed underneath it
+        region *r = a->regions;
+        while (r != NULL && r != val_region) {
+            r = r->next;
+        }
+        if (r == NULL) {
+            r = a->regions;
+            val_blk = NULL;
+        }
+        blk_hdr *blk = (val_blk != NULL && a->mutations == val_mutations)
+                       ? val_blk : r->first;
+
+        while (r != NULL) {
+            while (blk->size_status != 1) {
+                if (val_block(r, blk) != 0) {
+                    pthread_mutex_unlock(&a->lock);
+                    return -1;
+                }
+                blk = (blk_hdr*)((char*)blk + blk_size(blk));
+                if (max_blocks > 0 && --budget == 0) {
+                    val_region = r;
+                    val_blk = blk;
+                    val_mutations = a->mutations;
+                    pthread_mutex_unlock(&a->lock);
+                    return 0;
+                }
+            }
+            r = r->next;
+            if (r != NULL) {
+                blk = r->first;
+            }
+        }
+        pthread_mutex_unlock(&a->lock);
+
+        // this arena is clean - move on to the next one
+        val_arena = (val_arena + 1) % num_arenas;
+        val_region = NULL;
+        val_blk = NULL;
+    }
+    return 0;
+}
+
+/*
+ * Runs the batch coalescing sweep over every arena immediately,
+ * regardless of the queue thresholds
+ * A no-op when nothing is queued, so it is safe to call from an idle
+ * hook in any mode
  */
+void Mem_Coalesce(void) {
+    for (int i = 0; i < num_arenas; i++) {
+        arena *a = &arenas[i];
+        pthread_mutex_lock(&a->lock);
+        arena_coalesce_locked(a);
+        pthread_mutex_unlock(&a->lock);
+    }
+}
 
 /*
- * Function for allocating 'size' bytes
- * Returns address of allocated block on success
- * Returns NULL on failure
- * Here is what this function should accomplish
- * - Check for sanity of size - Return NULL when appropriate
- * - Round up size to a multiple of 8
- * - Traverse the list of blocks and allocate the best free block which can accommodate the requested size
- * - Also, when allocating a block - split it into two blocks
- * Tips: Be careful with pointer arithmetic
+ * Switches Mem_Free between immediate two-sided coalescing (the
+ * default) and deferred batch coalescing
+ * Disabling the mode sweeps the queues so no block stays parked
  */
-void* Mem_Alloc(int size) {
-    // Your code goes in here
-    
-    // return null if the size required is 0
-    if (size == 0){
-        return NULL;
-    }
-    
-    // Satisfy double word alignment
-    // Increment size to include the header
-    size += 4;
-    // add padding if needed
-    if(size % 8 != 0){
-        size = (size / 8 + 1) * 8;
+void Mem_SetDeferredCoalescing(int enable) {
+    defer_coalescing = enable;
+    if (!enable) {
+        Mem_Coalesce();
     }
-    
-    // initialize a pointer to point to the first block
-    blk_hdr* ptr = first_blk;
-    // initialize minimum size to be -1 indicating no minimum block found
-    int minSize = -1;
-    // initialize minimum block to point to the first block
-    blk_hdr* minBlock = first_blk;
-    
-    // Check if the end mark has been reached
-    while(ptr->size_status != 1){
-        // if current block is allocated
-        if( (ptr->size_status & 1) == 1){
-            // if the previous block is allocated
-            if( (ptr->size_status & 3) == 3){
-                // get the current size of the current block
-                int currSize = ptr->size_status - 3;
-                // skip to the next header
-                ptr = (void*)(ptr + currSize);
-            }
-            // if the previous block is not allocated
-            else{
-                // get the current size of the current block
-                int currSize = ptr->size_status-1;
-                // skip to the next header
-                ptr = (void*)(ptr + currSize);
-                Mem_Dump();
-            }
+}
+
+/*
+ * Sets the heap-profiler sampling rate: one sample per 'bytes' bytes
+ * allocated (0 disables sampling); changing the rate clears the ring
+ */
+void Mem_SetProfileRate(size_t bytes) {
+    prof_rate = bytes;
+    memset(prof_ring, 0, sizeof(prof_ring));
+    __atomic_store_n(&prof_pos, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Writes the profiler's callsite aggregates to fd, one line per
+ * callsite: "<return address> <samples> <bytes>", preceded by a
+ * comment header - trivially parseable and addr2line-friendly
+ * Aggregation happens in a fixed local table, so dumping allocates
+ * nothing; returns the number of callsites written
+ */
+int Mem_ProfileDump(int fd) {
+    struct {
+        void *site;
+        size_t count;
+        size_t bytes;
+    } agg[256];
+    int nagg = 0;
+
+    for (int i = 0; i < PROF_RING; i++) {
+        if (prof_ring[i].site == NULL) {
+            continue;
         }
-        
-        // if the current header is free and its size is bigger than requested
-        else if( ptr->size_status > size + 2 ){
-            // if it's the first free block that we encounter
-            if(minSize == -1){
-                // set the current minimum block to point to ptr
-                minBlock = ptr;
-                // set the minimum size to be the size of current minimum block size
-                minSize = minBlock->size_status - 2;
-            }
-            // if it's not the first free block that we encounter
-            else{
-                // if the previous block is allocated
-                if( (ptr->size_status & 2) == 2){
-                    // check size of the current block and compare it to minimum block
-                    // if size of the current block is smaller than minimum block
-                    if( (ptr->size_status - 2) < minSize){
-                        // update minSize
-                        minSize = ptr->size_status - 2;
-                        // update minBlock pointer
-                        minBlock = ptr;
-                    }
-                }
-                // if the previous block is free
-                else{
-                    // check size of the current block and compare it to minimum block
-                    // if size of the current block is smaller than minimum block
-                    if( (ptr->size_status) < minSize){
-                        // update minSize
-                        minSize = ptr->size_status;
-                        // update minBlock
-                        minBlock = ptr;
-                    }
-                }
+        int j = 0;
+        while (j < nagg && agg[j].site != prof_ring[i].site) {
+            j++;
+        }
+        if (j == nagg) {
+            if (nagg == (int)(sizeof(agg) / sizeof(agg[0]))) {
+                continue;
             }
+            agg[nagg].site = prof_ring[i].site;
+            agg[nagg].count = 0;
+            agg[nagg].bytes = 0;
+            nagg++;
         }
-        
-        //    if the current is free and the size is equal to requested
-        else if( ptr->size_status == size || ptr->size_status-2 == size){
-            // change its header's status
-            ptr->size_status += 1;
-            //return the address of the payload
-            return (void*)(ptr + 4);
+        agg[j].count += 1;
+        agg[j].bytes += prof_ring[i].bytes;
+    }
+
+    char line[80];
+    int len = snprintf(line, sizeof(line), "# site samples bytes\n");
+    if (write(fd, line, (size_t)len) != (ssize_t)len) {
+        return -1;
+    }
+    for (int j = 0; j < nagg; j++) {
+        len = snprintf(line, sizeof(line), "%p %zu %zu\n",
+                       agg[j].site, agg[j].count, agg[j].bytes);
+        if (write(fd, line, (size_t)len) != (ssize_t)len) {
+            return -1;
         }
-        
-        //    if the current block is free but size is smaller than requested
-        else{
-            // if the previous block is allocated
-            if( (ptr->size_status & 2) == 2){
-                // get the size of the current block
-                int currSize = ptr->size_status - 2;
-                // skip to the next header
-                ptr = (void*)(ptr + currSize); // ()?
-            }else{
-                // if the previous block is free
-                int currSize = ptr->size_status;
-                // skip to the next header
-                ptr = (void*)(ptr + currSize);
-            }
+    }
+    return nagg;
+}
+
+/*
+ * Raises the smallest remainder the split paths will carve off a
+ * chosen free block; smaller surpluses stay attached to the
+ * allocation instead of polluting the free lists as slivers
+ * Rounded up to a multiple of 8 and never below the structural
+ * minimum block size; takes effect on the next allocation
+ */
+void Mem_SetMinSplit(size_t bytes) {
+    bytes = (bytes + 7) & ~(size_t)7;
+    if (bytes < MIN_BLK_SIZE) {
+        bytes = MIN_BLK_SIZE;
+    }
+    min_split = bytes;
+}
+
+/*
+ * Asks for 2 MB pages behind heap regions mapped from now on: the
+ * MAP_HUGETLB pool when the kernel has one, MADV_HUGEPAGE otherwise
+ * Best called before Mem_Init so the initial region is covered too
+ */
+void Mem_SetHugePages(int enable) {
+    huge_pages = enable;
+}
+
+/*
+ * Switches the debug guard/quarantine mode on or off
+ * On: direct mappings sit flush against a PROT_NONE page (overruns
+ * fault on the spot, and so does every touch of a freed mapping),
+ * and freed heap blocks are poisoned and parked in a bounded
+ * quarantine before reuse, so stale reads hit poison and stale
+ * writes are reported to stderr when the block leaves the ring
+ * Cheap enough for a slice of live traffic: the quarantine is
+ * bounded and guards only apply at and above the mmap threshold
+ * Switching it off drains the quarantine
+ */
+void Mem_SetDebugGuards(int enable) {
+    debug_guards = enable;
+    if (!enable) {
+        quar_drain();
+    }
+}
+
+/*
+ * Selects the placement policy for the free-list search
+ * Unknown values fall back to best fit, the default
+ * May be called at any time; it takes effect on the next allocation
+ */
+void Mem_SetPolicy(int p) {
+    if (p != MEM_POLICY_FIRST && p != MEM_POLICY_NEXT) {
+        p = MEM_POLICY_BEST;
+    }
+    policy = p;
+}
+
+/*
+ * Sets how many arenas Mem_Init will carve the region into
+ * Must be called before Mem_Init; values are clamped to [1, MAX_ARENAS]
+ */
+void Mem_SetArenaCount(int n) {
+    if (n < 1) {
+        n = 1;
+    }
+    if (n > MAX_ARENAS) {
+        n = MAX_ARENAS;
+    }
+    requested_arenas = n;
+}
+
+/*
+ * Allows (or forbids, the default) the heap to map additional regions
+ * when every arena is exhausted, instead of failing the allocation
+ */
+void Mem_SetGrowable(int enable) {
+    growable = enable;
+}
+
+/*
+ * Enables the slab path for payloads of at most 'bytes' bytes
+ * (0, the default, disables it); clamped to the largest slot class
+ * The per-class locks are set up on the first enable
+ */
+void Mem_SetSlabThreshold(size_t bytes) {
+    static int slab_ready = 0;
+    if (bytes > (size_t)SLAB_MAX_CLASSES * 8) {
+        bytes = (size_t)SLAB_MAX_CLASSES * 8;
+    }
+    if (bytes != 0 && !slab_ready) {
+        for (int cls = 0; cls < SLAB_MAX_CLASSES; cls++) {
+            pthread_mutex_init(&slab_classes[cls].lock, NULL);
+            slab_classes[cls].partial = NULL;
         }
+        slab_ready = 1;
     }
-    
-    // if found a minimum block
-    if(minSize != -1){
-        // Do splitting
-        // if the previous block of minBlock is allocated
-        if( (minBlock->size_status & 2) == 2){
-            // update minBlock's header
-            minBlock->size_status = size + 3;
-        }
-        // if the previous block is free
-        else{
-            // update minBlock's header
-            minBlock->size_status = size + 1;
-        }
-        // initialize nextBlock to point to the next free block from splitting
-        blk_hdr* nextBlock = (void*)(minBlock + size);
-        // update header of next free block
-        nextBlock->size_status = minSize - size + 2;
-        // initialize footer to point to the footer of minBlock
-        blk_hdr* footer = (void*)(minBlock + minSize - 4);
-        //update the footer
-        footer->size_status = minSize - size;
-        // return the payload address of minimum block
-        return (void*)(minBlock + 4);
-    }
-    // if no such block is found
-    return NULL;
-    
+    slab_max = bytes;
 }
 
 /*
- * Function for freeing up a previously allocated block
- * Argument - ptr: Address of the block to be freed up
- * Returns 0 on success
- * Returns -1 on failure
- * Here is what this function should accomplish
- * - Return -1 if ptr is NULL
- * - Return -1 if ptr is not 8 byte aligned or if the block is already freed
- * - Mark the block as free
- * - Coalesce if one or both of the immediate neighbours are free
+ * Sets the payload size at and above which allocations are served
+ * from dedicated mappings instead of the arenas (default 256 KB)
+ * A value of 0 sends everything through the arenas
  */
-int Mem_Free(void *ptr) {
-    // Your code goes in here
-    
-    //    // if the ptr is NULL
-    //    if(ptr == NULL){
-    //        return -1;
-    //    }
-    //
-    //    // if the ptr is not 8 byte aligned
-    //    if( ((unsigned int)ptr&8) != 8 && ((unsigned int)ptr&0) != 0){
-    //        return -1;
-    //    }
-    //
-    //    // get the size_status of the header of the block that ptr points to
-    //    blk_hdr *currBlock = (blk_hdr*)ptr - 4; // Do I need to typecast ptr here?
-    //    int currSizeStatus = currBlock->size_status; // can size_status already be read?
-    //
-    //    // if the block ptr points to is already a free block
-    //    if( (currSizeStatus & 1) == 0){
-    //        return -1;
-    //    }
-    //
-    //    // if the previous block is allocated
-    //    if( (currSizeStatus & 2) == 2){
-    //        // get the size of the current block
-    //        int currSize = currSizeStatus - 3; //NEED TO CHECK WHETHER -2 OR -3
-    //        // get the block header of the next block
-    //        blk_hdr *nextBlock = currBlock + (currSize/4); // Does (blk_hdr*) jumps 4 bytes?
-    //        // read the size_status of the next block
-    //        int nextSizeStatus = nextBlock->size_status;
-    //
-    //        // if the next block is allocated
-    //        if( (nextSizeStatus & 1) == 1){
-    //            // jump 4 bytes back to set the footer of current block that is being freed
-    //            blk_hdr *footer = nextBlock-1; // CONFIRM AUTOSCALING!!
-    //            footer->size_status = currSize;
-    //            // Null out ptr
-    //            ptr = NULL;
-    //            // return to the current block header to reset the header
-    //        }
-    //        // if the next block is free, coalesce it
-    //        else{
-    //            // get the size of the next block
-    //            int nextSize = nextSizeStatus - 2;
-    //            // set the footer
-    //            blk_hdr *footer = nextBlock + (nextSize-4) / 4;
-    //            footer->size_status = currSize + nextSize;
-    //            // go back to update the current block's header
-    //            currBlock->size_status = footer->size_status + 2;
-    //            // Null out ptr
-    //            ptr = NULL; // Do I need to null out ptr?
-    //        }
-    //    }
-    //
-    //    //if the previous block is free
-    //    else{
-    //        // get the size of the current block
-    //        int currSize = currSizeStatus -1;
-    //        // get the previous block size by its footer
-    //        int prevSize = (currBlock - 1)->size_status; // Correct way to get the size by footer?
-    //        // a pointer to the previous block header
-    //        blk_hdr *prevBlock = currBlock - (prevSize/4);
-    //        // get the block header of the next block
-    //        blk_hdr *nextBlock = currBlock + (currSize/4);
-    //        // read the size_status of the next block
-    //        int nextSizeStatus = nextBlock->size_status;
-    //
-    //        // if the next block is allocated
-    //        if( (nextSizeStatus & 1) == 1){
-    //            // change the previous block header's size_status
-    //            prevBlock->size_status += currSize;
-    //            // set the footer of the new bigger free block
-    //            blk_hdr *footer = nextBlock - 1; // CHECK AUTOSCALING
-    //            footer->size_status = currSize + prevSize;
-    //            // null out ptr
-    //            ptr = NULL;
-    //        }
-    //
-    //        //if the next block is free
-    //        else{
-    //            // get the size of the next block
-    //            int nextSize = nextSizeStatus - 2;
-    //            // change the previous block header's size_status
-    //            prevBlock->size_status += (currSize + nextSize);
-    //            // set the footer of the new bigger free block
-    //            blk_hdr *footer = nextBlock + (nextSize-4) / 4;
-    //            footer->size_status = prevSize + currSize + nextSize;
-    //            // null out ptr
-    //            ptr = NULL;
-    //        }
-    //    }
-    //    // return 0 when success
-    return 0;
+void Mem_SetMmapThreshold(size_t bytes) {
+    mmap_threshold = bytes;
 }
 
 /*
@@ -315,24 +3011,33 @@ int Mem_Free(void *ptr) {
  * Argument - sizeOfRegion: Specifies the size of the chunk which needs to be allocated
  * Returns 0 on success and -1 on failure
  */
-int Mem_Init(int sizeOfRegion) {
-    int pagesize;
-    int padsize;
-    int fd;
-    int alloc_size;
+int Mem_Init(size_t sizeOfRegion) {
+    size_t pagesize;
+    size_t padsize;
+    size_t alloc_size;
     void* space_ptr;
-    blk_hdr* end_mark;
-    static int allocated_once = 0;
     
-    if (0 != allocated_once) {
-        fprintf(stderr,
-                "Error:mem.c: Mem_Init has allocated space during a previous call\n");
-        return -1;
-    }
-    if (sizeOfRegion <= 0) {
+    if (sizeOfRegion == 0) {
         fprintf(stderr, "Error:mem.c: Requested block size is not positive\n");
         return -1;
     }
+    if (0 != allocated_once) {
+        // subsequent calls extend the heap with one more region
+        // instead of failing
+        pagesize = (size_t)getpagesize();
+        alloc_size = (sizeOfRegion + pagesize - 1) & ~(pagesize - 1);
+        space_ptr = map_region(&alloc_size);
+        if (space_ptr == NULL) {
+            fprintf(stderr, "Error:mem.c: mmap cannot allocate space\n");
+            return -1;
+        }
+        arena *a = &arenas[grow_cursor % num_arenas];
+        grow_cursor += 1;
+        pthread_mutex_lock(&a->lock);
+        region_attach(a, NULL, space_ptr, alloc_size);
+        pthread_mutex_unlock(&a->lock);
+        return 0;
+    }
     
     // Get the pagesize
     pagesize = getpagesize();
@@ -344,44 +3049,377 @@ int Mem_Init(int sizeOfRegion) {
     
     alloc_size = sizeOfRegion + padsize;
     
-    // Using mmap to allocate memory
-    fd = open("/dev/zero", O_RDWR);
-    if (-1 == fd) {
-        fprintf(stderr, "Error:mem.c: Cannot open /dev/zero\n");
-        return -1;
-    }
-    space_ptr = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
-                     fd, 0);
-    if (MAP_FAILED == space_ptr) {
+    // Using mmap to allocate memory - anonymous and MAP_NORESERVE,
+    // so even a huge heap commits nothing until it is touched
+    space_ptr = map_region(&alloc_size);
+    if (space_ptr == NULL) {
         fprintf(stderr, "Error:mem.c: mmap cannot allocate space\n");
         allocated_once = 0;
         return -1;
     }
     
     allocated_once = 1;
-    
-    // for double word alignement and end mark
-    alloc_size -= 8;
-    
-    // To begin with there is only one big free block
-    // initialize heap so that first block meets
-    // double word alignement requirement
-    first_blk = (blk_hdr*) space_ptr + 1;
-    end_mark = (blk_hdr*)((void*)first_blk + alloc_size);
-    
-    // Setting up the header
-    first_blk->size_status = alloc_size;
-    
-    // Marking the previous block as busy
-    first_blk->size_status += 2;
-    
-    // Setting up the end mark and marking it as busy
-    end_mark->size_status = 1;
-    
-    // Setting up the footer
-    blk_hdr *footer = (blk_hdr*) ((char*)first_blk + alloc_size - 4);
-    footer->size_status = alloc_size;
-    
+
+    // Carve the mapping into one span per arena
+    // Spans are page multiples: the snapshot restore maps each region
+    // back from the floor of its page, so spans sharing a page would
+    // collide with each other on the way in
+    // Clamp the arena count so every span can hold at least one block
+    num_arenas = requested_arenas;
+    while (num_arenas > 1 &&
+           ((alloc_size / num_arenas) & ~((size_t)pagesize - 1)) <
+               REGION_OVERHEAD + MIN_BLK_SIZE) {
+        num_arenas -= 1;
+    }
+
+    size_t span = (alloc_size / num_arenas) & ~((size_t)pagesize - 1);
+    for (int i = 0; i < num_arenas; i++) {
+        arena *a = &arenas[i];
+        // the last arena takes whatever is left of the mapping
+        size_t this_span = (i == num_arenas - 1)
+                           ? alloc_size - (size_t)i * span : span;
+
+        // Start with empty bins and zeroed counters, then lay the
+        // initial region over the span
+        for (int b = 0; b < NUM_BINS; b++) {
+            a->bins[b] = NULL;
+        }
+        a->tree = NULL;
+        memset(&a->stats, 0, sizeof(a->stats));
+        a->regions = NULL;
+        a->rover = 0;
+        a->remote_frees = NULL;
+        a->deferred = NULL;
+        a->deferred_count = 0;
+        pthread_mutex_init(&a->lock, NULL);
+        region_attach(a, &a->region0,
+                      (char*)space_ptr + (size_t)i * span, this_span);
+    }
+
+    // keep the historical global pointing at the lowest block, and
+    // grow the heap later in steps of the initial size
+    first_blk = arenas[0].regions->first;
+    next_arena = 0;
+    grow_cursor = 0;
+    grow_region_size = alloc_size;
+
+    return 0;
+}
+
+/*
+ * Heap snapshot file layout: one header, one record per arena, one
+ * record per region, then the raw bytes of every region at
+ * page-aligned file offsets so they can be mapped straight back
+ * The in-heap pointers (free lists, the treap, boundary tags) are
+ * written as-is; they stay valid because Mem_InitFromFile maps every
+ * region back at its original address
+ */
+#define SNAP_MAGIC ((size_t)0x4d534e41)
+
+typedef struct snap_hdr {
+    size_t magic;
+    size_t hdr_size;            // HDR_SIZE of the writing build
+    int num_arenas;
+    int total_regions;
+    size_t grow_region_size;
+    int grow_cursor;
+    int pad;
+} snap_hdr;
+
+typedef struct snap_arena {
+    int rover;
+    int region_count;
+    mem_stats stats;
+    free_blk *bins[NUM_BINS];
+    tree_blk *tree;
+} snap_arena;
+
+typedef struct snap_region {
+    char *base;
+    size_t len;
+    char *high_water;
+    blk_hdr *first;
+    int embedded;               // descriptor lives inside the mapping
+    int pad;
+    size_t file_off;            // where the raw bytes sit in the file
+} snap_region;
+
+/*
+ * Function for writing the whole boundary-tag heap to a file
+ * Argument - path: file to (over)write
+ * Returns 0 on success and -1 on failure
+ * The calling thread's magazines are flushed and every remote-free
+ * and deferred queue settled first, so the image is self-contained;
+ * blocks cached by other threads' magazines stay busy in the image
+ * Call it from a quiesced process - a warm-restart checkpoint, not a
+ * concurrent backup
+ * Direct mappings and slab pages are not part of the image
+ */
+int Mem_Snapshot(const char *path) {
+    if (num_arenas == 0) {
+        return -1;
+    }
+    for (int c = 0; c < MAG_CLASSES; c++) {
+        mag_flush(&mags[c], mags[c].count);
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // settle all pending work and hold every lock while writing
+    int total_regions = 0;
+    for (int i = 0; i < num_arenas; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+        arena_drain_remote(&arenas[i]);
+        arena_coalesce_locked(&arenas[i]);
+        for (region *r = arenas[i].regions; r != NULL; r = r->next) {
+            total_regions += 1;
+        }
+    }
+
+    size_t page = (size_t)getpagesize();
+    size_t meta_size = sizeof(snap_hdr)
+                       + (size_t)num_arenas * sizeof(snap_arena)
+                       + (size_t)total_regions * sizeof(snap_region);
+    size_t data_off = (meta_size + page - 1) & ~(page - 1);
+
+    snap_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SNAP_MAGIC;
+    hdr.hdr_size = HDR_SIZE;
+    hdr.num_arenas = num_arenas;
+    hdr.total_regions = total_regions;
+    hdr.grow_region_size = grow_region_size;
+    hdr.grow_cursor = grow_cursor;
+
+    int ok = write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr);
+    for (int i = 0; ok && i < num_arenas; i++) {
+        arena *a = &arenas[i];
+        snap_arena sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.rover = a->rover;
+        sa.stats = a->stats;
+        memcpy(sa.bins, a->bins, sizeof(sa.bins));
+        sa.tree = a->tree;
+        for (region *r = a->regions; r != NULL; r = r->next) {
+            sa.region_count += 1;
+        }
+        ok = write(fd, &sa, sizeof(sa)) == (ssize_t)sizeof(sa);
+    }
+
+    // region records; the raw bytes start at page_floor(base) so the
+    // restore can map them at page granularity
+    size_t cur_off = data_off;
+    for (int i = 0; ok && i < num_arenas; i++) {
+        for (region *r = arenas[i].regions; ok && r != NULL;
+             r = r->next) {
+            snap_region sr;
+            memset(&sr, 0, sizeof(sr));
+            sr.base = r->base;
+            sr.len = (size_t)(r->limit - r->base);
+            sr.high_water = r->high_water;
+            sr.first = r->first;
+            sr.embedded = (r != &arenas[i].region0);
+            sr.file_off = cur_off;
+            char *lo = (char*)((size_t)r->base & ~(page - 1));
+            cur_off += ((size_t)(r->limit - lo) + page - 1)
+                       & ~(page - 1);
+            ok = write(fd, &sr, sizeof(sr)) == (ssize_t)sizeof(sr);
+        }
+    }
+
+    // the raw region bytes
+    for (int i = 0; ok && i < num_arenas; i++) {
+        for (region *r = arenas[i].regions; ok && r != NULL;
+             r = r->next) {
+            char *lo = (char*)((size_t)r->base & ~(page - 1));
+            size_t len = (size_t)(r->limit - lo);
+            size_t off = data_off;
+            // recompute this region's offset the same way as above
+            for (int j = 0; j < num_arenas; j++) {
+                for (region *q = arenas[j].regions; q != NULL;
+                     q = q->next) {
+                    if (q == r) {
+                        goto found;
+                    }
+                    char *qlo = (char*)((size_t)q->base & ~(page - 1));
+                    off += ((size_t)(q->limit - qlo) + page - 1)
+                           & ~(page - 1);
+                }
+            }
+found:
+            ok = pwrite(fd, lo, len, (off_t)off) == (ssize_t)len;
+        }
+    }
+
+    for (int i = num_arenas - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    if (close(fd) != 0) {
+        ok = 0;
+    }
+    return ok ? 0 : -1;
+}
+
+/*
+ * Maps one snapshot region back at exactly 'want' without clobbering
+ * whatever may already live there: MAP_FIXED_NOREPLACE where the
+ * kernel has it, otherwise a hinted mapping that is torn down again
+ * if the kernel placed it elsewhere (plain MAP_FIXED would silently
+ * replace an existing mapping - under ASLR that can be libc or the
+ * stack - and corrupt the process instead of failing)
+ */
+static int snap_map_region(int fd, void *want, size_t len, off_t off) {
+#ifdef MAP_FIXED_NOREPLACE
+    int flags = MAP_PRIVATE | MAP_FIXED_NOREPLACE;
+#else
+    int flags = MAP_PRIVATE;
+#endif
+    void *got = mmap(want, len, PROT_READ | PROT_WRITE, flags, fd, off);
+    if (got == MAP_FAILED) {
+        return -1;
+    }
+    // an old kernel treats the unknown flag (or the bare hint) as a
+    // wish, not a demand - detect and back out
+    if (got != want) {
+        munmap(got, len);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Unmaps every region a failing Mem_InitFromFile already restored,
+ * leaving the address space the way it was found
+ */
+static void snap_restore_abort(int num) {
+    size_t page = (size_t)getpagesize();
+    for (int i = 0; i < num; i++) {
+        region *r = arenas[i].regions;
+        while (r != NULL) {
+            // the descriptor may live inside the mapping - step off
+            // it before the pages go away
+            region *next = r->next;
+            char *lo = (char*)((size_t)r->base & ~(page - 1));
+            munmap(lo, (size_t)(r->limit - lo));
+            r = next;
+        }
+        arenas[i].regions = NULL;
+    }
+}
+
+/*
+ * Function for rebuilding the heap from a Mem_Snapshot file instead
+ * of calling Mem_Init
+ * Argument - path: snapshot file
+ * Returns 0 on success and -1 on failure
+ * Every region is mapped privately from the file at its original
+ * address, so the pointer-rich heap contents need no fixups and its
+ * pages fault in lazily on first touch; writes stay copy-on-write in
+ * this process
+ * Must run before Mem_Init, in the same build of the library; fails
+ * if any original address range is no longer free
+ */
+int Mem_InitFromFile(const char *path) {
+    if (num_arenas != 0) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    snap_hdr hdr;
+    if (read(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+        hdr.magic != SNAP_MAGIC || hdr.hdr_size != HDR_SIZE ||
+        hdr.num_arenas < 1 || hdr.num_arenas > MAX_ARENAS ||
+        hdr.total_regions < hdr.num_arenas) {
+        close(fd);
+        return -1;
+    }
+
+    size_t page = (size_t)getpagesize();
+    int mapped = 0;
+
+    // arena records: locks fresh, queues empty, index state restored
+    for (int i = 0; i < hdr.num_arenas; i++) {
+        snap_arena sa;
+        if (read(fd, &sa, sizeof(sa)) != (ssize_t)sizeof(sa)) {
+            close(fd);
+            return -1;
+        }
+        arena *a = &arenas[i];
+        pthread_mutex_init(&a->lock, NULL);
+        a->remote_frees = NULL;
+        a->deferred = NULL;
+        a->deferred_count = 0;
+        a->last_alloc_dirty = 0;
+        a->rover = sa.rover;
+        a->stats = sa.stats;
+        memcpy(a->bins, sa.bins, sizeof(a->bins));
+        a->tree = sa.tree;
+        a->regions = NULL;
+        // stash the region count in region0 until the records arrive
+        a->region0.next = NULL;
+        a->deferred_count = sa.region_count;
+    }
+
+    // region records, then map each one back where it came from
+    for (int i = 0; i < hdr.num_arenas; i++) {
+        arena *a = &arenas[i];
+        int count = a->deferred_count;
+        a->deferred_count = 0;
+        region *tail = NULL;
+        for (int k = 0; k < count; k++) {
+            snap_region sr;
+            if (read(fd, &sr, sizeof(sr)) != (ssize_t)sizeof(sr)) {
+                close(fd);
+                snap_restore_abort(hdr.num_arenas);
+                return -1;
+            }
+            char *lo = (char*)((size_t)sr.base & ~(page - 1));
+            size_t len = (size_t)(sr.base + sr.len - lo);
+            if (snap_map_region(fd, lo, len, (off_t)sr.file_off) != 0) {
+                close(fd);
+                snap_restore_abort(hdr.num_arenas);
+                return -1;
+            }
+            mapped += 1;
+            region *r = sr.embedded ? (region*)sr.base : &a->region0;
+            r->base = sr.base;
+            r->limit = sr.base + sr.len;
+            r->high_water = sr.high_water;
+            r->first = sr.first;
+            r->next = NULL;
+            if (tail == NULL) {
+                a->regions = r;
+            } else {
+                tail->next = r;
+            }
+            tail = r;
+        }
+    }
+    close(fd);
+    if (mapped != hdr.total_regions) {
+        snap_restore_abort(hdr.num_arenas);
+        return -1;
+    }
+
+    // the historical global: first block of the first arena's
+    // initial region, which sits at the tail of its list
+    region *r0 = arenas[0].regions;
+    while (r0 != NULL && r0->next != NULL) {
+        r0 = r0->next;
+    }
+    first_blk = (r0 != NULL) ? r0->first : NULL;
+
+    grow_region_size = hdr.grow_region_size;
+    grow_cursor = hdr.grow_cursor;
+    next_arena = 0;
+    allocated_once = 1;
+    num_arenas = hdr.num_arenas;
     return 0;
 }
 
@@ -402,13 +3440,12 @@ void Mem_Dump() {
     char p_status[5];
     char *t_begin = NULL;
     char *t_end = NULL;
-    int t_size;
+    size_t t_size;
     
-    blk_hdr *current = first_blk;
     counter = 1;
     
-    int busy_size = 0;
-    int free_size = 0;
+    size_t busy_size = 0;
+    size_t free_size = 0;
     int is_busy = -1;
     
     fprintf(stdout, "************************************Block list***\
@@ -417,51 +3454,221 @@ void Mem_Dump() {
     fprintf(stdout, "-------------------------------------------------\
             --------------------------------\n");
     
-    while (current->size_status != 1) {
-        t_begin = (char*)current;
-        t_size = current->size_status;
+    for (int i = 0; i < num_arenas; i++) {
+      for (region *r = arenas[i].regions; r != NULL; r = r->next) {
+        blk_hdr *current = r->first;
+        while (current->size_status != 1) {
+            t_begin = (char*)current;
+            t_size = current->size_status;
         
-        if (t_size & 1) {
-            // LSB = 1 => busy block
-            strcpy(status, "Busy");
-            is_busy = 1;
-            t_size = t_size - 1;
-        } else {
-            strcpy(status, "Free");
-            is_busy = 0;
-        }
+            if (t_size & 1) {
+                // LSB = 1 => busy block
+                strcpy(status, "Busy");
+                is_busy = 1;
+                t_size = t_size - 1;
+            } else {
+                strcpy(status, "Free");
+                is_busy = 0;
+            }
         
-        if (t_size & 2) {
-            strcpy(p_status, "Busy");
-            t_size = t_size - 2;
-        } else {
-            strcpy(p_status, "Free");
-        }
+            if (t_size & 2) {
+                strcpy(p_status, "Busy");
+                t_size = t_size - 2;
+            } else {
+                strcpy(p_status, "Free");
+            }
         
-        if (is_busy)
-            busy_size += t_size;
-        else
-            free_size += t_size;
+            if (is_busy)
+                busy_size += t_size;
+            else
+                free_size += t_size;
         
-        t_end = t_begin + t_size - 1;
+            t_end = t_begin + t_size - 1;
         
-        fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%d\n", counter, status,
-                p_status, (unsigned long int)t_begin, (unsigned long int)t_end, t_size);
+            fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%lu\n", counter, status,
+                    p_status, (unsigned long int)t_begin, (unsigned long int)t_end,
+                    (unsigned long int)t_size);
         
-        current = (blk_hdr*)((char*)current + t_size);
-        counter = counter + 1;
+            current = (blk_hdr*)((char*)current + t_size);
+            counter = counter + 1;
+        }
+      }
     }
     
     fprintf(stdout, "---------------------------------------------------\
             ------------------------------\n");
     fprintf(stdout, "***************************************************\
             ******************************\n");
-    fprintf(stdout, "Total busy size = %d\n", busy_size);
-    fprintf(stdout, "Total free size = %d\n", free_size);
-    fprintf(stdout, "Total size = %d\n", busy_size + free_size);
+    fprintf(stdout, "Total busy size = %lu\n", (unsigned long int)busy_size);
+    fprintf(stdout, "Total free size = %lu\n", (unsigned long int)free_size);
+    fprintf(stdout, "Total size = %lu\n", (unsigned long int)(busy_size + free_size));
     fprintf(stdout, "***************************************************\
             ******************************\n");
     fflush(stdout);
     
     return;
 }
+
+/*
+ * libc interposition layer
+ * Strong malloc/free/calloc/realloc (and the aligned variants) that
+ * forward to the Mem_ entry points, so an unmodified binary picks up
+ * this allocator via LD_PRELOAD or plain link order
+ * Allocations made before the heap exists are served from a small
+ * segregated bootstrap pool, so an early libc call (a fopen before
+ * main, say) does not force the heap into existence and shut out a
+ * later Mem_InitFromFile; only when the pool runs dry does the first
+ * caller bootstrap a growable heap, since a preloaded binary never
+ * calls Mem_Init itself
+ */
+
+/* Bump-only bootstrap pool: the few early allocations are never
+ * reused, so a free of one is a no-op and the bytes just stay */
+#define BOOT_POOL_BYTES ((size_t)1024 * 1024)
+
+static char boot_pool[BOOT_POOL_BYTES];
+static size_t boot_used = 0;
+
+/* Heap bootstrapped when the pool cannot carry a request */
+#define BOOT_HEAP_BYTES ((size_t)4 * 1024 * 1024)
+
+static pthread_once_t boot_once = PTHREAD_ONCE_INIT;
+
+static void interpose_boot_once(void) {
+    if (num_arenas == 0) {
+        Mem_SetGrowable(1);
+        Mem_Init(BOOT_HEAP_BYTES);
+    }
+}
+
+static void interpose_boot(void) {
+    if (num_arenas == 0) {
+        pthread_once(&boot_once, interpose_boot_once);
+    }
+}
+
+/* Whether ptr came from the bootstrap pool */
+static int boot_owns(void *ptr) {
+    return (char*)ptr >= boot_pool &&
+           (char*)ptr < boot_pool + BOOT_POOL_BYTES;
+}
+
+/*
+ * Serves one pre-init allocation from the bootstrap pool; the size
+ * word ahead of the payload tells realloc how much to copy later
+ * Returns NULL when the pool cannot carry the request, in which case
+ * the caller bootstraps the real heap
+ */
+static void* boot_alloc(size_t size, size_t alignment) {
+    if (alignment < 2 * sizeof(size_t)) {
+        alignment = 2 * sizeof(size_t);
+    }
+    size_t need = ((size + 7) & ~(size_t)7) + sizeof(size_t) + alignment;
+    if (size >= BOOT_POOL_BYTES || need < size) {
+        return NULL;
+    }
+    size_t at = __atomic_fetch_add(&boot_used, need, __ATOMIC_RELAXED);
+    if (at + need > BOOT_POOL_BYTES) {
+        return NULL;
+    }
+    char *base = boot_pool + at;
+    char *ptr = (char*)(((size_t)base + sizeof(size_t) + alignment - 1)
+                        & ~(alignment - 1));
+    ((size_t*)ptr)[-1] = size;
+    return ptr;
+}
+
+void* malloc(size_t size) {
+    // malloc(0) must hand out a unique, freeable pointer
+    if (size == 0) {
+        size = 1;
+    }
+    if (num_arenas == 0) {
+        void *ptr = boot_alloc(size, 0);
+        if (ptr != NULL) {
+            return ptr;
+        }
+        interpose_boot();
+    }
+    return Mem_Alloc(size);
+}
+
+void free(void *ptr) {
+    // bootstrap pool memory is never reused - freeing it is a no-op
+    if (ptr != NULL && !boot_owns(ptr)) {
+        Mem_Free(ptr);
+    }
+}
+
+void* calloc(size_t n, size_t size) {
+    if (n == 0 || size == 0) {
+        return malloc(1);
+    }
+    if (num_arenas == 0) {
+        if (n > (size_t)-1 / size) {
+            return NULL;
+        }
+        void *ptr = boot_alloc(n * size, 0);
+        if (ptr != NULL) {
+            memset(ptr, 0, n * size);
+            return ptr;
+        }
+        interpose_boot();
+    }
+    return Mem_Calloc(n, size);
+}
+
+void* realloc(void *ptr, size_t size) {
+    if (size == 0) {
+        size = 1;
+    }
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    // a pool allocation moves to wherever malloc serves from now
+    if (boot_owns(ptr)) {
+        size_t old = ((size_t*)ptr)[-1];
+        if (size <= old) {
+            return ptr;
+        }
+        void *fresh = malloc(size);
+        if (fresh != NULL) {
+            memcpy(fresh, ptr, old);
+        }
+        return fresh;
+    }
+    return Mem_Realloc(ptr, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    if (size == 0) {
+        size = 1;
+    }
+    if (num_arenas == 0 && alignment != 0 &&
+        (alignment & (alignment - 1)) == 0) {
+        void *ptr = boot_alloc(size, alignment);
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+    if (num_arenas == 0) {
+        interpose_boot();
+    }
+    return Mem_AllocAligned(size, alignment);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    // zero would pass both checks below (0 % 8 == 0 and 0 & -1 == 0)
+    // but POSIX wants EINVAL, not ENOMEM, for it
+    if (alignment == 0 ||
+        alignment % sizeof(void*) != 0 ||
+        (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *ptr = aligned_alloc(alignment, size != 0 ? size : 1);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
@@ -1,14 +1,207 @@
 #ifndef __mem_h__
 #define __mem_h__
 
-int Mem_Init(int sizeOfRegion);
-void* Mem_Alloc(int size);
+#include <stddef.h>
+
+int Mem_Init(size_t sizeOfRegion);
+void* Mem_Alloc(size_t size);
 int Mem_Free(void *ptr);
+void* Mem_Realloc(void *ptr, size_t size);
+void* Mem_AllocAligned(size_t size, size_t alignment);
+void* Mem_Calloc(size_t n, size_t size);
 void Mem_Dump();
 
-void* malloc(size_t size) {
-    return NULL;
-}
+/*
+ * Sets how many arenas Mem_Init carves the region into (default 1)
+ * Each thread is bound to an arena on its first allocation, so
+ * contention scales with the arena count instead of one global lock
+ * Must be called before Mem_Init; clamped to a sane range
+ */
+void Mem_SetArenaCount(int n);
+
+/*
+ * Defers coalescing: Mem_Free only queues the block, and runs of
+ * adjacent free blocks are merged in one linear sweep when the queue
+ * fills, when an allocation would otherwise fail, or when
+ * Mem_Coalesce is called - much cheaper for free-heavy bursts
+ * Off by default; disabling sweeps whatever is still queued
+ */
+void Mem_SetDeferredCoalescing(int enable);
+void Mem_Coalesce(void);
+
+/*
+ * Batch variants of Mem_Alloc and Mem_Free
+ * Mem_AllocBatch carves 'count' blocks of 'size' bytes out of one
+ * free block in a single search, so the payloads come out physically
+ * adjacent; Mem_FreeBatch sorts the pointers by address (in place)
+ * and frees every run of adjacent blocks as one block, touching the
+ * free lists once per run instead of once per block
+ * Both return 0 on success and -1 on failure
+ */
+int Mem_AllocBatch(size_t size, int count, void **out);
+int Mem_FreeBatch(void **ptrs, int count);
+
+/*
+ * Fixed-size object pool, carved out of the heap as one contiguous
+ * block: identical slots, no per-object header, LIFO reuse so the
+ * most recently freed object (still warm in cache) comes back first
+ * Mem_PoolAlloc/Mem_PoolFree are a free-list pop/push with no search
+ * and no lock - a pool belongs to one subsystem, which serializes
+ * access itself if it shares the handle across threads
+ * Mem_PoolAlloc returns NULL when all 'capacity' slots are out;
+ * destroying the pool invalidates every object handed out
+ */
+typedef struct mem_pool mem_pool;
+mem_pool* Mem_PoolCreate(size_t obj_size, int capacity);
+void* Mem_PoolAlloc(mem_pool *pool);
+int Mem_PoolFree(mem_pool *pool, void *ptr);
+int Mem_PoolDestroy(mem_pool *pool);
+
+/*
+ * Placement policies for the free-block search
+ * Best fit minimizes fragmentation, first fit minimizes search time,
+ * next fit resumes where the previous search stopped so repeated
+ * allocations do not rescan the same crowded bins
+ */
+#define MEM_POLICY_BEST  0
+#define MEM_POLICY_FIRST 1
+#define MEM_POLICY_NEXT  2
+
+/*
+ * Selects the placement policy (default MEM_POLICY_BEST)
+ */
+void Mem_SetPolicy(int policy);
+
+/*
+ * Writes the whole boundary-tag heap (all arenas and regions, with
+ * their addresses) to a snapshot file / maps one back at the same
+ * addresses, so a pointer-rich heap survives a restart as one lazy
+ * mmap instead of a rebuild
+ * Snapshot from a quiesced process; restore before Mem_Init in the
+ * same build of the library. Direct mappings and slab pages are not
+ * part of the image
+ * The restore maps each region at page granularity, so Mem_Init lays
+ * arena spans out on page boundaries; a heap carved any other way is
+ * not restorable
+ * Both return 0 on success and -1 on failure
+ */
+int Mem_Snapshot(const char *path);
+int Mem_InitFromFile(const char *path);
+
+/*
+ * Sets the smallest split remainder (default: the minimum block
+ * size); free-block remainders below it are allocated along with
+ * the block instead of becoming tiny fragments
+ */
+void Mem_SetMinSplit(size_t bytes);
+
+/*
+ * Backs heap regions with 2 MB pages where the system allows it
+ * (MAP_HUGETLB with a fallback to MADV_HUGEPAGE), shrinking dTLB
+ * pressure on very large heaps; call before Mem_Init
+ */
+void Mem_SetHugePages(int enable);
+
+/*
+ * Debug guard/quarantine mode (off by default), cheap enough for a
+ * slice of the live fleet: allocations at or above the mmap
+ * threshold are placed flush against a PROT_NONE guard page so an
+ * overrun faults immediately, and Mem_Free poisons blocks and parks
+ * them in a bounded quarantine before reuse so use-after-free reads
+ * hit poison (writes are reported to stderr when the block leaves
+ * the quarantine, and double frees of parked blocks return -1)
+ * Quarantined blocks still count as busy in the stats until they
+ * leave the ring; switching the mode off drains it
+ */
+void Mem_SetDebugGuards(int enable);
+
+/*
+ * Allows the heap to grow: when every arena is exhausted, Mem_Alloc
+ * maps an additional region (sized like the initial one) and keeps
+ * serving instead of returning NULL. Off by default, so a bounded
+ * heap still fails allocations when full. Calling Mem_Init again
+ * also extends the heap by one region of the given size.
+ */
+void Mem_SetGrowable(int enable);
+
+/*
+ * Returns the resident pages inside free blocks larger than threshold
+ * bytes to the OS without changing the heap layout - the blocks stay
+ * free and reusable, their backing pages are just dropped until touched
+ * Returns the number of bytes released
+ * Intended to be called from an idle hook after a burst of frees
+ */
+size_t Mem_Trim(size_t threshold);
+
+/*
+ * Checks up to max_blocks blocks of the heap's boundary tags (header
+ * sizes, prev-busy bits, free-block footers), resuming where the
+ * previous call stopped so each call bounds its own work; a
+ * non-positive count sweeps the whole heap
+ * Returns 0 when everything checked is consistent, -1 on corruption
+ * Building with -DMEM_CANARY (make canary) additionally puts a magic
+ * word at the end of every block, checked at Mem_Free, so overruns
+ * are caught at the free of the overrun block
+ */
+int Mem_Validate(int max_blocks);
+
+/*
+ * Serves payloads of at most 'bytes' bytes from per-size-class slab
+ * pages: a bitmap of equal slots with no per-object header, so a
+ * 16-byte node costs 16 bytes instead of header plus rounding
+ * Off by default (0) - slab objects do not come from the Mem_Init
+ * region and do not obey the boundary-tag placement policies
+ */
+void Mem_SetSlabThreshold(size_t bytes);
+
+/*
+ * Sets the payload size at and above which Mem_Alloc serves the
+ * request from a dedicated mapping that Mem_Free returns straight to
+ * the OS (default 256 KB; 0 disables the direct path)
+ */
+void Mem_SetMmapThreshold(size_t bytes);
+
+/*
+ * Snapshot of the allocator counters
+ * All byte counts include block headers/footers
+ * peak_bytes_busy sums each arena's own high-water mark; with more
+ * than one arena the per-arena peaks need not coincide in time, so
+ * the field is an upper bound on the true process-wide peak
+ */
+typedef struct mem_stats {
+    size_t bytes_busy;          // bytes currently in allocated blocks
+    size_t bytes_free;          // bytes currently in free blocks
+    int busy_blocks;            // number of allocated blocks
+    int free_blocks;            // number of free blocks
+    size_t largest_free_block;  // size of the largest free block
+    size_t peak_bytes_busy;     // high-water mark of bytes_busy
+} mem_stats;
+
+/*
+ * Fills in *stats from counters maintained incrementally by
+ * Mem_Alloc/Mem_Free - no heap traversal, safe to poll at high rates
+ */
+void Mem_GetStats(mem_stats *stats);
+
+/*
+ * Sampled heap profiler: records the caller's return address and the
+ * size of roughly one allocation per 'bytes' bytes allocated into a
+ * preallocated ring (cheap enough to stay on in production), and
+ * dumps "<site> <samples> <bytes>" aggregates per callsite to fd
+ * A rate of 0 (the default) turns sampling off
+ */
+void Mem_SetProfileRate(size_t bytes);
+int Mem_ProfileDump(int fd);
+
+/*
+ * Per-operation trace callback, active only in MEM_DEBUG builds
+ * op is the operation name ("alloc", "free", ...), ptr the payload
+ * address involved (NULL on failure) and size the block size in bytes
+ * In release builds the trace points compile to nothing and
+ * Mem_SetTraceCallback is a no-op
+ */
+typedef void (*mem_trace_fn)(const char *op, void *ptr, size_t size);
+void Mem_SetTraceCallback(mem_trace_fn fn);
 
 #endif // __mem_h__
 
@@ -8,6 +8,6 @@ int main() {
    assert(Mem_Init(4096) == 0);
    int* ptr = (int*) Mem_Alloc(sizeof(int));
    assert(ptr != NULL);
-   assert(((int)ptr) % 8 == 0);
+   assert(((size_t)ptr) % 8 == 0);
    exit(0);
 }
@@ -14,7 +14,7 @@ int main() {
     ptr[3] = (int*) Mem_Alloc(24);
 
     for (int i = 0; i < 4; i++) {
-        assert(((int)ptr[i]) % 8 == 0);
+        assert(((size_t)ptr[i]) % 8 == 0);
     }
 
     exit(0);
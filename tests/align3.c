@@ -18,7 +18,7 @@ int main() {
     ptr[8] = (Mem_Alloc(55));
    
     for (int i = 0; i < 9; i++) {
-        assert(((int)ptr[i]) % 8 == 0);
+        assert(((size_t)ptr[i]) % 8 == 0);
     }
     exit(0);
 }
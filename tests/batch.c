@@ -0,0 +1,49 @@
+/* batch alloc carves adjacent blocks; batch free merges the runs;
+ * a batch that cannot be satisfied leaves the heap untouched */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+
+#define COUNT 50
+
+int main() {
+   assert(Mem_Init(1 << 20) == 0);
+
+   void *out[COUNT];
+   assert(Mem_AllocBatch(64, COUNT, out) == 0);
+
+   // one span sliced up: the payloads sit at a constant stride
+   long stride = (char *)out[1] - (char *)out[0];
+   for (int i = 1; i < COUNT; i++) {
+      assert((char *)out[i] - (char *)out[i - 1] == stride);
+      memset(out[i], i, 64);
+   }
+   memset(out[0], 0, 64);
+   for (int i = 0; i < COUNT; i++) {
+      assert(((unsigned char *)out[i])[63] == (unsigned char)i);
+   }
+
+   // a batch no fallback can satisfy must unwind completely
+   mem_stats before, after;
+   Mem_GetStats(&before);
+   void *big[64];
+   assert(Mem_AllocBatch(1 << 17, 64, big) == -1);
+   Mem_GetStats(&after);
+   assert(after.bytes_busy == before.bytes_busy);
+   assert(after.busy_blocks == before.busy_blocks);
+
+   assert(Mem_FreeBatch(NULL, COUNT) == -1);
+   assert(Mem_FreeBatch(out, 0) == -1);
+
+   // free in scrambled order - the sort restores the runs
+   for (int i = 0; i < COUNT - 1; i += 2) {
+      void *tmp = out[i];
+      out[i] = out[i + 1];
+      out[i + 1] = tmp;
+   }
+   assert(Mem_FreeBatch(out, COUNT) == 0);
+   Mem_GetStats(&after);
+   assert(after.bytes_busy == 0);
+   exit(0);
+}
@@ -0,0 +1,269 @@
+/* trace-replay and synthetic benchmark driver
+ *
+ * usage: bench <workload> [ops]
+ *   workload is one of
+ *     uniform   - uniform sizes between 16 and 1024 bytes
+ *     skewed    - 80% small size classes (16-64), rest up to 4096
+ *     producer  - one thread allocates, another frees
+ *   or the path of a trace file with one operation per line:
+ *     a <slot> <size>   allocate <size> bytes into <slot>
+ *     f <slot>          free the pointer held in <slot>
+ *
+ * reports ops/sec, p50/p99/p999 per-op latency and the peak and
+ * final fragmentation of the heap
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mem.h"
+
+#define MAX_SLOTS 65536
+#define DEFAULT_OPS 1000000
+#define HEAP_BYTES (16 * 1024 * 1024)
+
+static void *slots[MAX_SLOTS];
+
+/* per-op latencies in nanoseconds; mmap'd so the harness's own
+ * bookkeeping never allocates from the heap it is measuring */
+static unsigned long *lat;
+static long lat_count;
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000ul
+           + (unsigned long)ts.tv_nsec;
+}
+
+/* xorshift generator - cheap and reproducible across runs */
+static unsigned int rng_state = 0x9d2c5681u;
+
+static unsigned int rng(void) {
+    unsigned int x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rng_state = x;
+    return x;
+}
+
+static int cmp_lat(const void *a, const void *b) {
+    unsigned long la = *(const unsigned long*)a;
+    unsigned long lb = *(const unsigned long*)b;
+    return (la > lb) - (la < lb);
+}
+
+static void report(const char *name, long ops, unsigned long wall_ns) {
+    qsort(lat, (size_t)lat_count, sizeof(lat[0]), cmp_lat);
+
+    mem_stats st;
+    Mem_GetStats(&st);
+    double frag = 0.0;
+    if (st.bytes_free > 0) {
+        frag = 100.0 * (1.0 - (double)st.largest_free_block
+                              / (double)st.bytes_free);
+    }
+
+    printf("%-10s %8ld ops in %6.1f ms  %9.0f ops/sec\n",
+           name, ops, (double)wall_ns / 1e6,
+           (double)ops * 1e9 / (double)wall_ns);
+    printf("  latency ns   p50 %6lu   p99 %6lu   p999 %6lu\n",
+           lat[lat_count / 2],
+           lat[lat_count - 1 - lat_count / 100],
+           lat[lat_count - 1 - lat_count / 1000]);
+    printf("  peak busy %zu bytes, final fragmentation %.1f%% "
+           "(%d free blocks)\n",
+           st.peak_bytes_busy, frag, st.free_blocks);
+}
+
+/* picks a payload size for the synthetic workloads */
+static size_t pick_size(int skewed) {
+    if (!skewed) {
+        return 16 + rng() % 1008;
+    }
+    if (rng() % 10 < 8) {
+        static const size_t classes[] = { 16, 24, 32, 48, 64 };
+        return classes[rng() % 5];
+    }
+    return 64 + rng() % 4032;
+}
+
+/* mixed alloc/free against a random slot table - the steady state is
+ * about half the slots live */
+static long run_mixed(long ops, int skewed) {
+    long done = 0;
+    for (long i = 0; i < ops; i++) {
+        int slot = (int)(rng() % 8192);
+        unsigned long t0 = now_ns();
+        if (slots[slot] != NULL) {
+            Mem_Free(slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = Mem_Alloc(pick_size(skewed));
+            if (slots[slot] == NULL) {
+                continue;
+            }
+        }
+        lat[lat_count++] = now_ns() - t0;
+        done++;
+    }
+    for (int slot = 0; slot < 8192; slot++) {
+        if (slots[slot] != NULL) {
+            Mem_Free(slots[slot]);
+            slots[slot] = NULL;
+        }
+    }
+    return done;
+}
+
+/* a bounded single-producer single-consumer ring of live pointers */
+#define RING 1024
+static void *ring[RING];
+static volatile long ring_head;
+static volatile long ring_tail;
+static long producer_ops;
+
+static void* consumer_main(void *arg) {
+    (void)arg;
+    long freed = 0;
+    while (freed < producer_ops) {
+        if (ring_tail == ring_head) {
+            continue;
+        }
+        void *ptr = ring[ring_tail % RING];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        Mem_Free(ptr);
+        __atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELEASE);
+        freed++;
+    }
+    return NULL;
+}
+
+/* producer-consumer: every block is allocated on one thread and freed
+ * on the other, the worst case for any thread-local caching */
+static long run_producer(long ops) {
+    producer_ops = ops;
+    ring_head = 0;
+    ring_tail = 0;
+    pthread_t consumer;
+    assert(pthread_create(&consumer, NULL, consumer_main, NULL) == 0);
+
+    long done = 0;
+    for (long i = 0; i < ops; i++) {
+        while (ring_head - ring_tail == RING) {
+            /* ring full - wait for the consumer */
+        }
+        unsigned long t0 = now_ns();
+        void *ptr = Mem_Alloc(pick_size(1));
+        lat[lat_count++] = now_ns() - t0;
+        if (ptr == NULL) {
+            producer_ops--;
+            continue;
+        }
+        ring[ring_head % RING] = ptr;
+        __atomic_store_n(&ring_head, ring_head + 1, __ATOMIC_RELEASE);
+        done++;
+    }
+    pthread_join(consumer, NULL);
+    return done;
+}
+
+/* reads one trace line through a raw descriptor - stdio would pull
+ * its buffers from the heap under measurement */
+static int read_line(int fd, char *line, int cap) {
+    int len = 0;
+    while (len < cap - 1) {
+        char c;
+        ssize_t n = read(fd, &c, 1);
+        if (n != 1 || c == '\n') {
+            break;
+        }
+        line[len++] = c;
+    }
+    line[len] = '\0';
+    return len;
+}
+
+/* replays a recorded trace of 'a <slot> <size>' / 'f <slot>' lines */
+static long run_trace(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "bench: cannot open trace %s\n", path);
+        exit(1);
+    }
+    long done = 0;
+    char line[128];
+    while (read_line(fd, line, sizeof(line)) > 0) {
+        char op;
+        int slot;
+        long size;
+        int n = sscanf(line, " %c %d %ld", &op, &slot, &size);
+        if (n < 2 || slot < 0 || slot >= MAX_SLOTS) {
+            continue;
+        }
+        unsigned long t0 = now_ns();
+        if (op == 'a' && n == 3 && slots[slot] == NULL) {
+            slots[slot] = Mem_Alloc((size_t)size);
+        } else if (op == 'f' && slots[slot] != NULL) {
+            Mem_Free(slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            continue;
+        }
+        lat[lat_count++] = now_ns() - t0;
+        done++;
+        if (lat_count == DEFAULT_OPS) {
+            break;
+        }
+    }
+    close(fd);
+    for (int slot = 0; slot < MAX_SLOTS; slot++) {
+        if (slots[slot] != NULL) {
+            Mem_Free(slots[slot]);
+            slots[slot] = NULL;
+        }
+    }
+    return done;
+}
+
+int main(int argc, char **argv) {
+    const char *workload = (argc > 1) ? argv[1] : "uniform";
+    long ops = (argc > 2) ? atol(argv[2]) : DEFAULT_OPS;
+    if (ops <= 0 || ops > 100000000) {
+        ops = DEFAULT_OPS;
+    }
+
+    lat = mmap(NULL, (size_t)ops * sizeof(lat[0]),
+               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+               -1, 0);
+    assert(lat != MAP_FAILED);
+
+    Mem_SetGrowable(1);
+    assert(Mem_Init(HEAP_BYTES) == 0);
+
+    long done;
+    unsigned long t0 = now_ns();
+    if (strcmp(workload, "uniform") == 0) {
+        done = run_mixed(ops, 0);
+    } else if (strcmp(workload, "skewed") == 0) {
+        done = run_mixed(ops, 1);
+    } else if (strcmp(workload, "producer") == 0) {
+        done = run_producer(ops);
+    } else {
+        done = run_trace(workload);
+    }
+    unsigned long wall = now_ns() - t0;
+
+    if (done == 0 || lat_count == 0) {
+        fprintf(stderr, "bench: no operations completed\n");
+        return 1;
+    }
+    report(workload, done, wall);
+    return 0;
+}
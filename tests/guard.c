@@ -0,0 +1,48 @@
+/* guard mode: freed heap blocks are poisoned and parked, a double
+ * free of a parked block is refused, and disabling the mode drains
+ * the quarantine back to an empty heap */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+
+int main() {
+   assert(Mem_Init(1 << 16) == 0);
+   Mem_SetDebugGuards(1);
+
+   // above the magazine classes, so no refill leaves cached blocks
+   // busy and the final stats check can expect an empty heap
+   unsigned char *p = Mem_Alloc(200);
+   assert(p != NULL);
+   memset(p, 0xff, 200);
+   assert(Mem_Free(p) == 0);
+
+   // parked, not recycled: the payload past the quarantine bookkeeping
+   // reads as poison, so a stale reader sees garbage instead of data
+   for (int i = 16; i < 200; i++) {
+      assert(p[i] == 0x5a);
+   }
+
+   // freeing a parked block again is a double free
+   assert(Mem_Free(p) == -1);
+
+   // a parked block must not be handed out again while quarantined
+   void *q = Mem_Alloc(200);
+   assert(q != NULL && q != (void *)p);
+   assert(Mem_Free(q) == 0);
+
+   // large requests go to a dedicated guarded mapping and still
+   // round-trip through alloc/write/free
+   unsigned char *big = Mem_Alloc(512 * 1024);
+   assert(big != NULL);
+   memset(big, 0xab, 512 * 1024);
+   assert(Mem_Free(big) == 0);
+
+   // disabling drains the quarantine; the heap coalesces back
+   Mem_SetDebugGuards(0);
+   mem_stats st;
+   Mem_GetStats(&st);
+   assert(st.bytes_busy == 0);
+   assert(st.busy_blocks == 0);
+   exit(0);
+}
@@ -0,0 +1,46 @@
+/* fixed-size pool contract: distinct slots, LIFO reuse, exhaustion,
+ * and rejection of pointers that are not live slots */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+
+#define CAP 32
+
+int main() {
+   assert(Mem_Init(1 << 16) == 0);
+
+   mem_pool *pool = Mem_PoolCreate(40, CAP);
+   assert(pool != NULL);
+
+   void *obj[CAP];
+   for (int i = 0; i < CAP; i++) {
+      obj[i] = Mem_PoolAlloc(pool);
+      assert(obj[i] != NULL);
+      memset(obj[i], i, 40);
+   }
+   // all capacity slots are out
+   assert(Mem_PoolAlloc(pool) == NULL);
+   for (int i = 0; i < CAP; i++) {
+      assert(((unsigned char *)obj[i])[39] == (unsigned char)i);
+   }
+
+   // the most recently freed slot comes back first
+   assert(Mem_PoolFree(pool, obj[5]) == 0);
+   assert(Mem_PoolFree(pool, obj[9]) == 0);
+   assert(Mem_PoolAlloc(pool) == obj[9]);
+   assert(Mem_PoolAlloc(pool) == obj[5]);
+
+   // not a slot: outside the pool, between slots, or null
+   int local;
+   assert(Mem_PoolFree(pool, &local) == -1);
+   assert(Mem_PoolFree(pool, (char *)obj[0] + 8) == -1);
+   assert(Mem_PoolFree(pool, NULL) == -1);
+   assert(Mem_PoolFree(NULL, obj[0]) == -1);
+
+   assert(Mem_PoolDestroy(pool) == 0);
+   mem_stats st;
+   Mem_GetStats(&st);
+   assert(st.bytes_busy == 0);
+   exit(0);
+}
@@ -0,0 +1,27 @@
+/* calloc must zero memory recycled through a realloc surplus carve */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+
+int main() {
+   assert(Mem_Init(4096) == 0);
+
+   void *p = Mem_Alloc(200);
+   assert(p != NULL);
+   memset(p, 0xff, 200);
+
+   // grows in place by absorbing the free successor, then carves the
+   // surplus back off - the carve writes index links and the caller
+   // may dirty the payload, all above the old high-water mark
+   p = Mem_Realloc(p, 600);
+   assert(p != NULL);
+   memset(p, 0xff, 600);
+
+   unsigned char *q = Mem_Calloc(1, 100);
+   assert(q != NULL);
+   for (int i = 0; i < 100; i++) {
+      assert(q[i] == 0);
+   }
+   exit(0);
+}
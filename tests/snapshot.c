@@ -0,0 +1,65 @@
+/* snapshot a multi-arena heap, exec, restore it and walk the data
+ *
+ * the heap size is deliberately not a multiple of arenas * pagesize
+ * so the arena spans only restore if Mem_Init laid them out on page
+ * boundaries; the list nodes land in different arenas and their
+ * pointers must survive the restart unchanged
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mem.h"
+
+#define SNAP_PATH "/tmp/mem_snapshot_test.snap"
+#define NODES 200
+
+struct node {
+   int value;
+   struct node *next;
+};
+
+int main(int argc, char **argv) {
+   if (getenv("SNAPSHOT_RESTORE") != NULL) {
+      assert(Mem_InitFromFile(SNAP_PATH) == 0);
+      struct node *head =
+         (struct node *)strtoul(getenv("SNAPSHOT_HEAD"), NULL, 16);
+      for (int i = 0; i < NODES; i++) {
+         assert(head != NULL && head->value == i);
+         head = head->next;
+      }
+      assert(head == NULL);
+      // the restored heap must still allocate and free
+      void *p = Mem_Alloc(100);
+      assert(p != NULL);
+      assert(Mem_Free(p) == 0);
+      unlink(SNAP_PATH);
+      exit(0);
+   }
+
+   Mem_SetArenaCount(3);
+   assert(Mem_Init((1 << 20) + 4096) == 0);
+
+   struct node *head = NULL, *tail = NULL;
+   for (int i = 0; i < NODES; i++) {
+      struct node *n = Mem_Alloc(sizeof(struct node));
+      assert(n != NULL);
+      n->value = i;
+      n->next = NULL;
+      if (tail != NULL) {
+         tail->next = n;
+      } else {
+         head = n;
+      }
+      tail = n;
+   }
+   assert(Mem_Snapshot(SNAP_PATH) == 0);
+
+   char buf[32];
+   sprintf(buf, "%lx", (unsigned long)head);
+   setenv("SNAPSHOT_RESTORE", "1", 1);
+   setenv("SNAPSHOT_HEAD", buf, 1);
+   execv(argv[0], argv);
+   assert(0);
+}
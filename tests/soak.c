@@ -0,0 +1,190 @@
+/* fragmentation stress and soak harness
+ *
+ * usage: soak <workload> [ops] [threshold]
+ *   workload is one of
+ *     random      - uniform churn of mixed sizes, the steady state of
+ *                   a long-lived server
+ *     sawtooth    - repeated ramp-up to the high-water mark followed
+ *                   by a full tear-down
+ *     adversarial - pins alternating small holes across the heap and
+ *                   then churns sizes that fit none of them, the
+ *                   worst interleaving we have seen in production
+ *   ops is the operation count (default 2000000) and threshold the
+ *   external fragmentation percentage that fails the run (default 40)
+ *
+ * external fragmentation is 1 - largest_free_block / bytes_free from
+ * the stats API, sampled every SAMPLE_EVERY operations; the run fails
+ * if any sample crosses the threshold, so a release certified by
+ * 'make run_soak' held its worst case over the whole soak, not just
+ * at the final state
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+
+#define MAX_SLOTS 131072
+#define DEFAULT_OPS 2000000
+#define SAMPLE_EVERY 10000
+#define HEAP_BYTES (16 * 1024 * 1024)
+
+static void *slots[MAX_SLOTS];
+
+/* worst fragmentation seen across the whole run */
+static double peak_frag;
+static long samples;
+
+/* xorshift generator - cheap and reproducible across runs */
+static unsigned int rng_state = 0x9d2c5681u;
+
+static unsigned int rng(void) {
+    unsigned int x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rng_state = x;
+    return x;
+}
+
+/* one fragmentation sample; returns the current percentage */
+static double sample_frag(void) {
+    mem_stats st;
+    Mem_GetStats(&st);
+    double frag = 0.0;
+    if (st.bytes_free > 0) {
+        frag = 100.0 * (1.0 - (double)st.largest_free_block
+                              / (double)st.bytes_free);
+    }
+    if (frag > peak_frag) {
+        peak_frag = frag;
+    }
+    samples++;
+    return frag;
+}
+
+/* uniform churn: mixed sizes against a random slot table, about half
+ * the slots live in the steady state */
+static void run_random(long ops) {
+    for (long i = 0; i < ops; i++) {
+        int slot = (int)(rng() % 8192);
+        if (slots[slot] != NULL) {
+            Mem_Free(slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = Mem_Alloc(16 + rng() % 2032);
+        }
+        if (i % SAMPLE_EVERY == 0) {
+            sample_frag();
+        }
+    }
+}
+
+/* grow to the high-water mark with ramping sizes, then tear the whole
+ * ramp down again - every cycle the heap must coalesce back */
+static void run_sawtooth(long ops) {
+    long done = 0;
+    while (done < ops) {
+        int live = 0;
+        while (live < 4096 && done < ops) {
+            slots[live] = Mem_Alloc(16 + (size_t)(live % 512) * 8);
+            if (slots[live] == NULL) {
+                break;
+            }
+            live++;
+            done++;
+            if (done % SAMPLE_EVERY == 0) {
+                sample_frag();
+            }
+        }
+        for (int i = 0; i < live; i++) {
+            Mem_Free(slots[i]);
+            slots[i] = NULL;
+            done++;
+            if (done % SAMPLE_EVERY == 0) {
+                sample_frag();
+            }
+        }
+    }
+}
+
+/* fill the heap with small blocks, free every other one so the holes
+ * can never merge, then churn sizes that fit none of them */
+static void run_adversarial(long ops) {
+    long done = 0;
+    int live = 0;
+    while (live < MAX_SLOTS && done < ops) {
+        slots[live] = Mem_Alloc(56);
+        if (slots[live] == NULL) {
+            break;
+        }
+        live++;
+        done++;
+    }
+    for (int i = 0; i < live && done < ops; i += 2) {
+        Mem_Free(slots[i]);
+        slots[i] = NULL;
+        done++;
+        if (done % SAMPLE_EVERY == 0) {
+            sample_frag();
+        }
+    }
+    // the pinned holes are 64 bytes; these requests skip them all
+    while (done < ops) {
+        void *ptr = Mem_Alloc(200);
+        done++;
+        if (ptr != NULL) {
+            Mem_Free(ptr);
+            done++;
+        }
+        if (done % SAMPLE_EVERY <= 1) {
+            sample_frag();
+        }
+    }
+    for (int i = 0; i < live; i++) {
+        if (slots[i] != NULL) {
+            Mem_Free(slots[i]);
+            slots[i] = NULL;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *workload = (argc > 1) ? argv[1] : "random";
+    long ops = (argc > 2) ? atol(argv[2]) : DEFAULT_OPS;
+    double threshold = (argc > 3) ? atof(argv[3]) : 40.0;
+    if (ops <= 0 || ops > 1000000000) {
+        ops = DEFAULT_OPS;
+    }
+
+    // a bounded heap, so fragmentation shows up instead of being
+    // papered over by growth
+    assert(Mem_Init(HEAP_BYTES) == 0);
+
+    if (strcmp(workload, "random") == 0) {
+        run_random(ops);
+    } else if (strcmp(workload, "sawtooth") == 0) {
+        run_sawtooth(ops);
+    } else if (strcmp(workload, "adversarial") == 0) {
+        run_adversarial(ops);
+    } else {
+        fprintf(stderr, "soak: unknown workload %s\n", workload);
+        return 1;
+    }
+    for (int i = 0; i < MAX_SLOTS; i++) {
+        if (slots[i] != NULL) {
+            Mem_Free(slots[i]);
+        }
+    }
+    double final_frag = sample_frag();
+
+    printf("%-12s %8ld ops  %5ld samples  peak frag %5.1f%%  "
+           "final %5.1f%%  limit %.0f%%\n",
+           workload, ops, samples, peak_frag, final_frag, threshold);
+    if (peak_frag > threshold) {
+        printf("soak: FAIL - fragmentation crossed the threshold\n");
+        return 1;
+    }
+    printf("soak: PASS\n");
+    return 0;
+}